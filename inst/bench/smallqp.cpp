@@ -0,0 +1,173 @@
+// Benchmark of the working set subproblem solvers of the bound
+// constrained SVMs (C-bsvc, eps-bsvr, spoc-svc, kbb-svc), see
+// solve_bqp in src/svm.cpp.  For every size n from 2 to 30 it solves
+// the same random subproblems
+//
+//   min 0.5 x'Qx + p'x,  0 <= x <= C
+//
+// with solve_bqp, which tries the active-set method for n <= 16 and
+// falls back to TRON, and with TRON alone (solvebqp), and prints the
+// time per subproblem of both, the number of fallbacks and the largest
+// differences of the solutions and objective values.  It exits with
+// status 1 if solve_bqp ends at a worse objective than TRON or at a
+// different solution.  Build and run with
+//
+//   make -f smallqp.mk
+//   ./smallqp [problems per size]
+//
+// from inst/bench of the kernlab sources.  Q is the matrix of a
+// C-bsvc subproblem, y_i y_j (K(x_i,x_j) + 1) for an rbf kernel, and
+// the starting point is a mix of variables at either bound and free
+// ones, as when the solver picks up a working set.
+
+#include <chrono>
+#include <vector>
+#include "svm.cpp"
+
+static double urand(unsigned long long &s)
+{
+	s = s*6364136223846793005ULL + 1442695040888963407ULL;
+	return ((s>>11) & ((1ULL<<53)-1)) / (double)(1ULL<<53);
+}
+
+static double nrand(unsigned long long &s)
+{
+	double u = urand(s) + 1e-12, v = urand(s);
+	return sqrt(-2*log(u))*cos(2*M_PI*v);
+}
+
+static double objective(int n, const double *Q, const double *p, const double *x)
+{
+	double f = 0;
+	for (int i=0;i<n;i++)
+	{
+		double s = 0;
+		for (int j=0;j<n;j++)
+			s += Q[i*n+j]*x[j];
+		f += x[i]*(0.5*s + p[i]);
+	}
+	return f;
+}
+
+struct Problem {
+	std::vector<double> Q, p, C, x0;
+};
+
+static Problem make_problem(int n, unsigned long long &s)
+{
+	const int d = 4;
+	const double gamma = 0.5;
+	Problem P;
+	std::vector<double> z(n*d);
+	std::vector<int> y(n);
+	for (int i=0;i<n;i++)
+	{
+		y[i] = urand(s) < 0.5 ? -1 : 1;
+		for (int k=0;k<d;k++)
+			z[i*d+k] = nrand(s) + 0.5*y[i];
+	}
+	P.Q.resize(n*n);
+	for (int i=0;i<n;i++)
+		for (int j=0;j<n;j++)
+		{
+			double r = 0;
+			for (int k=0;k<d;k++)
+				r += (z[i*d+k]-z[j*d+k])*(z[i*d+k]-z[j*d+k]);
+			P.Q[i*n+j] = y[i]*y[j]*(exp(-gamma*r) + 1);
+		}
+	P.C.assign(n, 1);
+	P.x0.resize(n);
+	for (int i=0;i<n;i++)
+	{
+		double u = urand(s);
+		P.x0[i] = u < 0.4 ? 0 : (u < 0.6 ? P.C[i] : urand(s)*P.C[i]);
+	}
+	// p = G - Q x0 for a gradient G of the whole problem
+	P.p.resize(n);
+	for (int i=0;i<n;i++)
+	{
+		P.p[i] = -1 + nrand(s);
+		for (int j=0;j<n;j++)
+			P.p[i] -= P.Q[i*n+j]*P.x0[j];
+	}
+	return P;
+}
+
+int main(int argc, char **argv)
+{
+	const int reps = argc > 1 ? atoi(argv[1]) : 2000;
+	const int nmax = 30;
+	unsigned long long seed = 1;
+	BQP qp;
+	qp.eps = 1e-4;			// eps/10 of Solver_B with tol = 0.001
+	qp.x = new double[nmax];
+	qp.C = new double[nmax];
+	qp.p = new double[nmax];
+	qp.Q = new double[nmax*nmax];
+	qp.work = new double[BQP_WORKSIZE(nmax)];
+	qp.iwork = new int[nmax];
+	bool ok = true;
+
+	printf("%4s %12s %12s %8s %9s %10s %10s\n", "n", "solve_bqp", "solvebqp",
+	       "speedup", "fallback", "max|dx|", "max df");
+	for (int n=2;n<=nmax;n++)
+	{
+		std::vector<Problem> P;
+		for (int r=0;r<reps;r++)
+			P.push_back(make_problem(n, seed));
+		std::vector<double> xa(n*reps), xb(n*reps);
+		double t[2];
+		for (int m=0;m<2;m++)
+		{
+			std::vector<double> &xs = m == 0 ? xa : xb;
+			auto start = std::chrono::steady_clock::now();
+			for (int r=0;r<reps;r++)
+			{
+				qp.n = n;
+				memcpy(qp.Q, &P[r].Q[0], n*n*sizeof(double));
+				memcpy(qp.p, &P[r].p[0], n*sizeof(double));
+				memcpy(qp.C, &P[r].C[0], n*sizeof(double));
+				memcpy(qp.x, &P[r].x0[0], n*sizeof(double));
+				if (m == 0)
+					solve_bqp(&qp);
+				else
+					solvebqp(&qp);
+				memcpy(&xs[r*n], qp.x, n*sizeof(double));
+			}
+			t[m] = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		}
+
+		// how often the active-set method gives up, outside the timing
+		int fallback = 0;
+		if (n <= SMALL_BQP_MAX)
+			for (int r=0;r<reps;r++)
+			{
+				qp.n = n;
+				memcpy(qp.Q, &P[r].Q[0], n*n*sizeof(double));
+				memcpy(qp.p, &P[r].p[0], n*sizeof(double));
+				memcpy(qp.C, &P[r].C[0], n*sizeof(double));
+				memcpy(qp.x, &P[r].x0[0], n*sizeof(double));
+				if (!(n <= 8 ? solve_small_bqp<8>(&qp) : solve_small_bqp<SMALL_BQP_MAX>(&qp)))
+					fallback++;
+			}
+
+		double dx = 0, df = 0;
+		for (int r=0;r<reps;r++)
+		{
+			const Problem &Pr = P[r];
+			double fa = objective(n, &Pr.Q[0], &Pr.p[0], &xa[r*n]);
+			double fb = objective(n, &Pr.Q[0], &Pr.p[0], &xb[r*n]);
+			// positive when solve_bqp is worse than TRON
+			df = max(df, (fa - fb)/max(1.0, fabs(fb)));
+			for (int i=0;i<n;i++)
+				dx = max(dx, fabs(xa[r*n+i] - xb[r*n+i])/Pr.C[i]);
+		}
+		if (df > 1e-6 || dx > 1e-2)
+			ok = false;
+		printf("%4d %10.3fus %10.3fus %8.2f %9d %10.2e %10.2e\n", n,
+		       1e6*t[0]/reps, 1e6*t[1]/reps, t[1]/t[0], fallback, dx, df);
+	}
+	if (!ok)
+		printf("solve_bqp and solvebqp disagree\n");
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,37 @@
+# Build of the subproblem solver benchmark smallqp.cpp, which includes
+# src/svm.cpp to reach its internal solvers and links the TRON sources
+# of the package, R and the BLAS and LAPACK R uses.  Run from
+# inst/bench of the kernlab sources:
+#
+#   make -f smallqp.mk
+#   ./smallqp
+
+SRC      = ../../src
+R        = R
+CXX      = c++
+CC       = cc
+CXXFLAGS = -O2
+CFLAGS   = -O2
+RCPPFLAGS = $(shell $(R) CMD config --cppflags)
+RLIBS    = $(shell $(R) CMD config --ldflags) \
+	   $(shell $(R) CMD config LAPACK_LIBS) \
+	   $(shell $(R) CMD config BLAS_LIBS) \
+	   $(shell $(R) CMD config FLIBS)
+
+TRON     = solvebqp dtron dspcg dtrpcg dcauchy dprsrch dbreakpt dgpnrm \
+	   dgpstep dprecond dtrqsol dhprod misc
+OBJ      = $(TRON:%=%.o) svmmodel.o
+
+smallqp: smallqp.cpp $(SRC)/svm.cpp $(SRC)/svm.h $(OBJ)
+	$(CXX) $(CXXFLAGS) $(RCPPFLAGS) -I$(SRC) smallqp.cpp $(OBJ) -o $@ $(RLIBS)
+
+%.o: $(SRC)/%.c $(SRC)/svm.h
+	$(CC) $(CFLAGS) $(RCPPFLAGS) -I$(SRC) -c $< -o $@
+
+svmmodel.o: $(SRC)/svmmodel.cpp $(SRC)/svmmodel.h $(SRC)/svm.h
+	$(CXX) $(CXXFLAGS) -I$(SRC) -c $(SRC)/svmmodel.cpp -o $@
+
+clean:
+	rm -f smallqp $(OBJ)
+
+.PHONY: clean
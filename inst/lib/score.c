@@ -0,0 +1,85 @@
+/* Example client of libkernlabmodel: predicts the rows of a text file
+   with a model written by saveModel, one row at a time.
+
+     score [-f] model.bin [rows.txt]
+
+   reads rows of ncol numbers separated by white space from rows.txt or
+   the standard input and prints for each the predicted label, or the
+   value for regression, followed by the decision values.  With -f the
+   rows are scored as floats with svm_model_score_float. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "svmmodel.h"
+
+int main(int argc, char **argv)
+{
+	const char *error;
+	struct svm_model *model;
+	FILE *in = stdin;
+	double *row, *dec;
+	float *rowf;
+	void *work;
+	int single = 0, i, k, n = 0;
+
+	if (argc > 1 && strcmp(argv[1], "-f") == 0) {
+		single = 1;
+		argc--;
+		argv++;
+	}
+	if (argc < 2 || argc > 3) {
+		fprintf(stderr, "usage: score [-f] model.bin [rows.txt]\n");
+		return 2;
+	}
+	model = svm_model_map(argv[1], &error);
+	if (model == NULL) {
+		fprintf(stderr, "%s: %s\n", error, argv[1]);
+		return 1;
+	}
+	if (argc == 3 && (in = fopen(argv[2], "r")) == NULL) {
+		perror(argv[2]);
+		svm_model_free(model);
+		return 1;
+	}
+
+	row = (double *) malloc(sizeof(double) * model->ncol);
+	rowf = (float *) malloc(sizeof(float) * model->ncol);
+	dec = (double *) malloc(sizeof(double) * model->nmodel);
+	work = malloc(svm_model_work_size(model));
+	for (;;) {
+		for (i = 0; i < model->ncol; i++)
+			if (fscanf(in, "%lf", &row[i]) != 1)
+				break;
+		if (i < model->ncol) {
+			if (i > 0 || !feof(in)) {
+				fprintf(stderr, "row %d: expected %d values\n",
+					n + 1, model->ncol);
+				n = -1;
+			}
+			break;
+		}
+		for (i = 0; i < model->ncol; i++)
+			rowf[i] = (float) row[i];
+		k = single ? svm_model_score_float(model, rowf, dec, work)
+			   : svm_model_score(model, row, dec, work);
+		if (k < 0)
+			printf("%.10g", dec[0]);
+		else if (model->nclass > 0)
+			printf("%s", svm_model_label(model, k));
+		else
+			printf("%s", k ? "TRUE" : "FALSE");
+		for (i = 0; i < model->nmodel; i++)
+			printf(" %.10g", dec[i]);
+		printf("\n");
+		n++;
+	}
+
+	free(row);
+	free(rowf);
+	free(dec);
+	free(work);
+	if (in != stdin)
+		fclose(in);
+	svm_model_free(model);
+	return n < 0;
+}
@@ -1,7 +1,7 @@
 #include <stdlib.h>
 #include <R_ext/BLAS.h>
+#include "svm.h"
 
-extern void *xmalloc(size_t);
 /* LEVEL 1 BLAS */
 /* extern double ddot_(int *, double *, int *, double *, int *);
  extern double dnrm2_(int *, double *, int *); */
@@ -10,8 +10,9 @@ extern void *xmalloc(size_t);
 /* MINPACK 2 */
 extern void dbreakpt(int, double *, double *, double *, double *, int *, double *, double *);
 extern void dgpstep(int, double *, double *, double *, double, double *, double *);
+extern void dhprod(struct tron_hess *, int, double *, double *);
 
-void dcauchy(int n, double *x, double *xl, double *xu, double *A, double *g, double delta, double *alpha, double *s)
+void dcauchy(int n, double *x, double *xl, double *xu, struct tron_hess *H, double *g, double delta, double *alpha, double *s, double *wa)
 {
 /*
 c     **********
@@ -56,9 +57,9 @@ c       xu is a double precision array of dimension n.
 c         On entry xu is the vector of upper bounds.
 c         On exit xu is unchanged.
 c
-c       A is a double precision array of dimension n*n.
-c         On entry A specifies the matrix A.
-c         On exit A is unchanged.
+c       H is a pointer to the Hessian.
+c         On entry H specifies the matrix A.
+c         On exit H is unchanged.
 c
 c       g is a double precision array of dimension n.
 c         On entry g specifies the gradient g.
@@ -76,18 +77,17 @@ c       s is a double precision array of dimension n.
 c         On entry s need not be specified.
 c         On exit s is the Cauchy step s[alpha].
 c
+c       wa is a double precision work array of dimension n.
+c
 c     **********
 */
 
-	double one = 1, zero = 0;
-
 	/* Constant that defines sufficient decrease.
 	Interpolation and extrapolation factors. */
 	double mu0 = 0.01, interpf = 0.1, extrapf = 10;
 	
 	int search, interp, nbrpt, nsteps = 1, i, inc = 1;
 	double alphas, brptmax, brptmin, gts, q; 
-	double *wa = (double *) xmalloc(sizeof(double)*n);
 	
 	/* Find the minimal and maximal break-point on x - alpha*g. */
 	for (i=0;i<n;i++)
@@ -101,7 +101,7 @@ c     **********
 		interp = 1;
 	else
 	{
-		F77_CALL(dsymv)("U", &n, &one, A, &n, s, &inc, &zero, wa, &inc);
+		dhprod(H, n, s, wa);
 		gts = F77_CALL(ddot)(&n, g, &inc, s, &inc);
 		q = 0.5*F77_CALL(ddot)(&n, s, &inc, wa, &inc) + gts;
 		interp = q >= mu0*gts ? 1 : 0;
@@ -123,7 +123,7 @@ c     **********
 			dgpstep(n, x, xl, xu, -(*alpha), g, s);
 			if (F77_CALL(dnrm2)(&n, s, &inc) <= delta)
 			{
-				F77_CALL(dsymv)("U", &n, &one, A, &n, s, &inc, &zero, wa, &inc);
+				dhprod(H, n, s, wa);
 				gts = F77_CALL(ddot)(&n, g, &inc, s, &inc);
 				q = 0.5 * F77_CALL(ddot)(&n, s, &inc, wa, &inc) + gts;
 				search = q > mu0*gts ? 1 : 0;
@@ -147,7 +147,7 @@ c     **********
 			dgpstep(n, x, xl, xu, -(*alpha), g, s);
 			if (F77_CALL(dnrm2)(&n, s, &inc) <= delta)
 			{
-				F77_CALL(dsymv)("U", &n, &one, A, &n, s, &inc, &zero, wa, &inc);
+				dhprod(H, n, s, wa);
 				gts = F77_CALL(ddot)(&n, g, &inc, s, &inc);
 				q = 0.5 * F77_CALL(ddot)(&n, s, &inc, wa, &inc) + gts;
 				search = q < mu0*gts ? 1 : 0;
@@ -158,6 +158,4 @@ c     **********
 		*alpha = alphas;
 		dgpstep(n, x, xl, xu, -(*alpha), g, s);
 	}
-
-	free(wa);
 }
@@ -0,0 +1,96 @@
+#include <stdlib.h>
+#include <R_ext/BLAS.h>
+#include "svm.h"
+/* LEVEL 2 BLAS */
+/*extern int dsymv_(char *, int *, double *, double *, int *, double *, int *, double *, double *, int *);*/
+/*extern int dtrsv_(char *, char *, char *, int *, double *, int *, double *, int *);*/
+
+void dhprod(struct tron_hess *H, int n, double *v, double *Hv)
+{
+/*
+c     *********
+c
+c     Subroutine dhprod
+c
+c     This subroutine computes the product Hv = H*v of the Hessian
+c     restricted to the variables H->ind with a vector v. A dense
+c     H->B is multiplied directly, otherwise v is scattered into the
+c     full space, multiplied by H->ctx->hv and the result gathered.
+c
+c	parameters:
+c
+c       H is a pointer to the Hessian.
+c         On exit H is unchanged.
+c
+c       n is an integer variable.
+c         On entry n is the number of variables in H->ind.
+c         On exit n is unchanged.
+c
+c       v is a double precision array of dimension n.
+c         On entry v specifies the vector v.
+c         On exit v is unchanged.
+c
+c       Hv is a double precision array of dimension n.
+c         On entry Hv need not be specified.
+c         On exit Hv contains the product H*v.
+c
+c     **********
+*/
+	int i, inc = 1;
+	double one = 1, zero = 0;
+
+	if (H->B)
+		F77_CALL(dsymv)("U", &n, &one, H->B, &n, v, &inc, &zero, Hv, &inc);
+	else if (H->ind == NULL)
+		H->ctx->hv(H->ctx, n, v, Hv);
+	else
+	{
+		for (i=0;i<n;i++)
+			H->v[H->ind[i]] = v[i];
+		H->ctx->hv(H->ctx, H->nfull, H->v, H->Hv);
+		for (i=0;i<n;i++)
+		{
+			Hv[i] = H->Hv[H->ind[i]];
+			H->v[H->ind[i]] = 0;
+		}
+	}
+}
+
+void dhsolve(struct tron_hess *H, char *trans, int n, double *v)
+{
+/*
+c     *********
+c
+c     Subroutine dhsolve
+c
+c     This subroutine solves L*x = v or L'*x = v for the
+c     preconditioner H->L, which is either a dense lower triangular
+c     matrix or a diagonal stored as a vector.
+c
+c	parameters:
+c
+c       H is a pointer to the Hessian.
+c         On exit H is unchanged.
+c
+c       trans is a character variable.
+c         On entry trans is "N" to solve L*x = v, "T" for L'*x = v.
+c         On exit trans is unchanged.
+c
+c       n is an integer variable.
+c         On entry n is the number of variables in H->ind.
+c         On exit n is unchanged.
+c
+c       v is a double precision array of dimension n.
+c         On entry v specifies the vector v.
+c         On exit v contains the solution x.
+c
+c     **********
+*/
+	int i, inc = 1;
+
+	if (H->B)
+		F77_CALL(dtrsv)("L", trans, "N", &n, H->L, &n, v, &inc);
+	else
+		for (i=0;i<n;i++)
+			v[i] /= H->L[i];
+}
@@ -2,38 +2,39 @@
 #include <stdio.h>
 #include <string.h>
 #include <R_ext/Lapack.h>
+#include "svm.h"
 /* LAPACK */
 /* extern int dpotf2_(char *, int *, double *, int *, int *); */
 
-double dcholfact(int n, double *A, double *L)
+double dcholfact(struct tron_ctx *ctx, int n, double *A, double *L)
 {
 	/* if A is p.d. , A = L*L'
-	   if A is p.s.d. , A + lambda*I = L*L'; */  
+	   if A is p.s.d. , A + lambda*I = L*L';
+	   lambda is kept in ctx and grows over the solve */  
 	int indef, i;
-	static double lambda = 1e-3/512/512;
 	memcpy(L, A, sizeof(double)*n*n);
 	F77_CALL(dpotf2)("L", &n, L, &n, &indef);
 	if (indef != 0)
 	{
 		memcpy(L, A, sizeof(double)*n*n);
 		for (i=0;i<n;i++)
-			L[i*n+i] += lambda; 
+			L[i*n+i] += ctx->lambda; 
 		F77_CALL(dpotf2)("L", &n, L, &n, &indef);
 		if (indef != 0)
 		{
 			//printf("A is not positive semi-definite\n");
-			lambda *= 2;
+			ctx->lambda *= 2;
 		}
-		return lambda;
+		return ctx->lambda;
 	}
 	return 0;
 }
 
-double dprecond(int n, double *A, double *C)
+double dprecond(struct tron_ctx *ctx, int n, double *A, double *C)
 {
 	/* Given a dense symmetric positive semidefinite matrix A, this
 	subroutine computes the precondictioner C. Use full Cholesky
 	factorization instead of incomplete Cholesky factorization that
 	orginal TRON uses. It is the major difference between the two. */
-	return dcholfact(n, A, C);
+	return dcholfact(ctx, n, A, C);
 }
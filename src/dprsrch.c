@@ -1,9 +1,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <R_ext/BLAS.h>
+#include "svm.h"
 extern double mymin(double, double);
 extern double mymax(double, double);
-extern void *xmalloc(size_t);
 /* LEVEL 1 BLAS */
 /*extern double ddot_(int *, double *, int *, double *, int *);*/
 /*extern int daxpy_(int *, double *, double *, int *, double *, int *);*/
@@ -12,8 +12,9 @@ extern void *xmalloc(size_t);
 /* MINPACK 2 */
 extern void dbreakpt(int, double *, double *, double *, double *, int *, double *, double *);
 extern void dgpstep(int, double *, double *, double *, double, double *, double *);
+extern void dhprod(struct tron_hess *, int, double *, double *);
 
-void dprsrch(int n, double *x, double *xl, double *xu, double *A, double *g, double *w)
+void dprsrch(int n, double *x, double *xl, double *xu, struct tron_hess *H, double *g, double *w, double *wa)
 {
 /*
 c     **********
@@ -60,9 +61,9 @@ c       xu is a double precision array of dimension n.
 c         On entry xu is the vector of upper bounds.
 c         On exit xu is unchanged.
 c
-c       A is a double precision array of dimension n*n.
-c         On entry A specifies the matrix A
-c         On exit A is unchanged.
+c       H is a pointer to the Hessian.
+c         On entry H specifies the matrix A.
+c         On exit H is unchanged.
 c
 c       g is a double precision array of dimension n.
 c         On entry g specifies the vector g.
@@ -72,17 +73,17 @@ c       w is a double prevision array of dimension n.
 c         On entry w specifies the search direction.
 c         On exit w is the step s[alpha].
 c
+c       wa is a double precision work array of dimension 2*n.
+c
 c     **********
 */
 
-	double one = 1, zero = 0;
-
 	/* Constant that defines sufficient decrease. */
 	/* Interpolation factor. */
 	double mu0 = 0.01, interpf = 0.5;
 	
-	double *wa1 = (double *) xmalloc(sizeof(double)*n);
-	double *wa2 = (double *) xmalloc(sizeof(double)*n);
+	double *wa1 = wa;
+	double *wa2 = wa + n;
 
 	/* Set the initial alpha = 1 because the quadratic function is 
 	decreasing in the ray x + alpha*w for 0 <= alpha <= 1 */
@@ -101,7 +102,7 @@ c     **********
 		decrease condition. */
 		nsteps++;
 		dgpstep(n, x, xl, xu, alpha, w, wa1);
-		F77_CALL(dsymv)("U", &n, &one, A, &n, wa1, &inc, &zero, wa2, &inc);
+		dhprod(H, n, wa1, wa2);
 		gts = F77_CALL(ddot)(&n, g, &inc, wa1, &inc);
 		q = 0.5*F77_CALL(ddot)(&n, wa1, &inc, wa2, &inc) + gts;
 		if (q <= mu0*gts)
@@ -126,7 +127,4 @@ c     **********
 	for (i=0;i<n;i++)
 		x[i] = mymax(xl[i], mymin(x[i], xu[i]));
 	memcpy(w, wa1, sizeof(double)*n);
-
-	free(wa1);
-	free(wa2);
 }
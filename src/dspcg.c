@@ -1,6 +1,7 @@
 #include <stdlib.h>
+#include <math.h>
 #include <R_ext/BLAS.h>
-extern void *xmalloc(size_t);
+#include "svm.h"
 extern double mymin(double, double);
 extern double mymax(double, double);
 /* LEVEL 1 BLAS */
@@ -9,11 +10,13 @@ extern double mymax(double, double);
 /*extern int dsymv_(char *, int *, double *, double *, int *, double *, int *, double *, double *, int *);*/
 /*extern void dtrsv_(char *, char *, char *, int *, double *, int *, double *, int *);*/
 /* MINPACK 2 */
-extern void dprsrch(int, double *, double *, double *, double *, double *, double *);
-extern double dprecond(int, double *, double *);
-extern void dtrpcg(int, double*, double *, double, double *, double, double, double *, int *, int *);
+extern void dprsrch(int, double *, double *, double *, struct tron_hess *, double *, double *, double *);
+extern double dprecond(struct tron_ctx *, int, double *, double *);
+extern void dtrpcg(int, struct tron_hess *, double *, double, double, double, double *, int *, int *, double *);
+extern void dhprod(struct tron_hess *, int, double *, double *);
+extern void dhsolve(struct tron_hess *, char *, int, double *);
 
-void dspcg(int n, double *x, double *xl, double *xu, double *A, double *g, double delta, double rtol, double *s, int *info)
+void dspcg(struct tron_ctx *ctx, int n, double *x, double *xl, double *xu, double *g, double delta, double rtol, double *s, int *info, double *work, int *iwork)
 {
 /*
 c     *********
@@ -29,8 +32,8 @@ c     The quadratic is defined by
 c
 c           q(x[0]+s) = 0.5*s'*A*s + g'*s,
 c
-c     where x[0] is a base point provided by the user, A is a symmetric
-c     positive semidefinite dense matrix, and g is a vector.
+c     where x[0] is a base point provided by the user, A is the
+c     symmetric positive semidefinite Hessian of ctx, and g is a vector.
 c
 c     At each stage we have an approximate minimizer x[k], and generate
 c     a direction p[k] by solving the subproblem
@@ -42,7 +45,9 @@ c     trust region bound.
 c
 c           B = A(free:free),
 c
-c     where free is the set of free variables at x[k]. Given p[k],
+c     where free is the set of free variables at x[k]. A dense B is
+c     preconditioned by its Cholesky factor, a matrix-free B by its
+c     diagonal. Given p[k],
 c     the next minimizer x[k+1] is generated by a projected search.
 c
 c     The starting point for this subroutine is x[1] = x[0] + s, where
@@ -61,6 +66,11 @@ c     In this case the final x satisfies q(x) < q(x[k]).
 c
 c	parameters:
 c
+c       ctx is a pointer to the state of the solve.
+c         On entry ctx specifies the Hessian A, either dense as
+c            ctx->A or through ctx->hv and ctx->diag.
+c         On exit ctx is unchanged but for ctx->lambda.
+c
 c       n is an integer variable.
 c         On entry n is the number of variables.
 c         On exit n is unchanged.
@@ -77,10 +87,6 @@ c       xu is a double precision array of dimension n.
 c         On entry xu is the vector of upper bounds.
 c         On exit xu is unchanged.
 c
-c       A is a double precision array of dimension n*n.
-c         On entry A specifies the matrix A.
-c         On exit A is unchanged.
-c
 c       g is a double precision array of dimension n.
 c         On entry g must contain the vector g.
 c         On exit g is unchanged.
@@ -108,22 +114,45 @@ c                       in the face defined by the free variables.
 c
 c             info = 2  Termination. The trust region bound does
 c                       not allow further progress.
+c
+c       work is a double precision work array of dimension 2*n*n+10*n
+c         for a dense A, 13*n otherwise.
+c
+c       iwork is an integer work array of dimension n.
 */
 	int i, j, nfaces, nfree, inc = 1, infotr, iters = 0, itertr;
 	double gfnorm, gfnormf, stol = 1e-16, alpha;
-	double one = 1, zero = 0;
-	
-	double *B = (double *) xmalloc(sizeof(double)*n*n);
-	double *L = (double *) xmalloc(sizeof(double)*n*n);
-	double *w = (double *) xmalloc(sizeof(double)*n);
-	double *wa = (double *) xmalloc(sizeof(double)*n);
-	double *wxl = (double *) xmalloc(sizeof(double)*n);
-	double *wxu = (double *) xmalloc(sizeof(double)*n);	
-	int *indfree = (int *) xmalloc(sizeof(int)*n);
-	double *gfree = (double *) xmalloc(sizeof(double)*n);
+	double *A = ctx->A;
+	double *B = A ? work : NULL;
+	double *L = A ? work + n*n : work;
+	double *w = A ? work + 2*n*n : work + 3*n;
+	double *wa = w + n;
+	double *wxl = w + 2*n;
+	double *wxu = w + 3*n;	
+	int *indfree = iwork;
+	double *gfree = w + 4*n;
+	double *wtr = w + 5*n;
+	struct tron_hess full, H;
+
+	full.ctx = ctx;
+	full.B = A;
+	full.L = NULL;
+	full.ind = NULL;
+	full.nfull = n;
+	full.v = full.Hv = NULL;
+	H.ctx = ctx;
+	H.B = B;
+	H.L = L;
+	H.ind = A ? NULL : indfree;
+	H.nfull = n;
+	H.v = A ? NULL : work + n;
+	H.Hv = A ? NULL : work + 2*n;
+	if (!A)
+		for (j=0;j<n;j++)
+			H.v[j] = 0;
 
 	/* Compute A*(x[1] - x[0]) and store in w. */
-	F77_CALL(dsymv)("U", &n, &one, A, &n, s, &inc, &zero, w, &inc);
+	dhprod(&full, n, s, w);
       
 	/* Compute the Cauchy point. */
 	for (j=0;j<n;j++)
@@ -153,24 +182,29 @@ c                       not allow further progress.
 			goto return0;
 		}
 
-		/* Obtain the submatrix of A for the free variables. 
+		/* Obtain the submatrix of A for the free variables,
+		or the diagonal preconditioner if A is matrix-free.
 		Compute the gradient grad q(x[k]) = g + A*(x[k] - x[0]),
 		of q at x[k] for the free variables.
 		Recall that w contains  A*(x[k] - x[0]).
 		Compute the norm of the reduced gradient Z'*g. */
 		for (i=0;i<nfree;i++)
 		{
-			for (j=0;j<nfree;j++)
-				B[i*nfree+j] = A[indfree[i]*n+indfree[j]];
+			if (A)
+				for (j=0;j<nfree;j++)
+					B[i*nfree+j] = A[indfree[i]*n+indfree[j]];
+			else
+				L[i] = sqrt(ctx->diag[indfree[i]]);
 			wa[i] = g[indfree[i]];
 			gfree[i] = w[indfree[i]] + wa[i];
 		}
 		gfnorm = F77_CALL(dnrm2)(&nfree, wa, &inc);
 
-		alpha = dprecond(nfree, B, L);
-		dtrpcg(nfree, B, gfree, delta, L, rtol*gfnorm, stol, w, &itertr, &infotr);
+		if (A)
+			alpha = dprecond(ctx, nfree, B, L);
+		dtrpcg(nfree, &H, gfree, delta, rtol*gfnorm, stol, w, &itertr, &infotr, wtr);
 		iters += itertr;
-		F77_CALL(dtrsv)("L", "T", "N", &nfree, L, &nfree, w, &inc);
+		dhsolve(&H, "T", nfree, w);
 
 		/* Use a projected search to obtain the next iterate.
 		The projected search algorithm stores s[k] in w. */
@@ -180,7 +214,7 @@ c                       not allow further progress.
 			wxl[j] = xl[indfree[j]];
 			wxu[j] = xu[indfree[j]];
 		}
-		dprsrch(nfree, wa, wxl, wxu, B, gfree, w);
+		dprsrch(nfree, wa, wxl, wxu, &H, gfree, w, wtr);
 		
 		/* Update the minimizer and the step.
 		Note that s now contains x[k+1] - x[0].	*/
@@ -191,7 +225,7 @@ c                       not allow further progress.
 		}
 
 		/* Compute A*(x[k+1] - x[0]) and store in w. */
-		F77_CALL(dsymv)("U", &n, &one, A, &n, s, &inc, &zero, w, &inc);
+		dhprod(&full, n, s, w);
          
 		/* Compute the gradient grad q(x[k+1]) = g + A*(x[k+1] - x[0])
 		of q at x[k+1] for the free variables. */
@@ -217,12 +251,5 @@ c                       not allow further progress.
 	}
 
 return0:
-	free(B);
-	free(L);
-	free(w);
-	free(wa);
-	free(wxl);
-	free(wxu);
-	free(indfree);
-	free(gfree);		
+	return;
 } 
@@ -3,24 +3,20 @@
 #include <stdio.h>
 #include <string.h>
 #include <R_ext/BLAS.h>
+#include "svm.h"
 
-extern void *xmalloc(size_t);
 extern double mymin(double, double);
 extern double mymax(double, double);
-extern int ufv(int, double *, double *);
-extern int ugrad(int, double *, double *);
-extern int uhes(int, double *, double **);
 /* LEVEL 1 BLAS */
 /*extern double dnrm2_(int *, double *, int *);*/
 /*extern double ddot_(int *, double *, int *, double *, int *);*/
-/* LEVEL 2 BLAS */
-/*extern int dsymv_(char *, int *, double *, double *, int *, double *, int *, double *, double *, int *);*/
 /* MINPACK 2 */
 extern double dgpnrm(int, double *, double *, double *, double *);
-extern void dcauchy(int, double *, double *, double *, double *, double *, double, double *, double *, double *);
-extern void dspcg(int, double *, double *, double *, double *, double *, double, double, double *, int *);
+extern void dcauchy(int, double *, double *, double *, struct tron_hess *, double *, double, double *, double *, double *);
+extern void dspcg(struct tron_ctx *, int, double *, double *, double *, double *, double, double, double *, int *, double *, int *);
+extern void dhprod(struct tron_hess *, int, double *, double *);
 
-void dtron(int n, double *x, double *xl, double *xu, double gtol, double frtol, double fatol, double fmin, int maxfev, double cgtol) 
+void dtron(struct tron_ctx *ctx, int n, double *x, double *xl, double *xu, double gtol, double frtol, double fatol, double fmin, int maxfev, double cgtol, double *work, int *iwork) 
 {
 /*
 c     *********
@@ -34,13 +30,15 @@ c     Jorge More' into this version which is suitable for this
 c     special case.
 c
 c     This subroutine implements a trust region Newton method for the
-c     solution of large bound-constrained quadratic optimization problems
+c     solution of large bound-constrained optimization problems
 c
-c           min { f(x)=0.5*x'*A*x + g0'*x : xl <= x <= xu }
+c           min { f(x) : xl <= x <= xu }
 c
-c     where the Hessian matrix A is dense and positive semidefinite. The
-c     user must define functions which evaluate the function, gradient, 
-c     and the Hessian matrix.
+c     where f is convex, typically the quadratic 0.5*x'*A*x + g0'*x
+c     with a dense positive semidefinite Hessian A. The user must
+c     define functions which evaluate the function, the gradient, 
+c     and the product of the Hessian with a vector, and may give the
+c     Hessian as a dense matrix instead.
 c
 c     The user must choose an initial approximation x to the minimizer,
 c     lower bounds, upper bounds, quadratic terms, linear terms, and
@@ -48,6 +46,11 @@ c     constants about termination criterion.
 c
 c	parameters:
 c
+c       ctx is a pointer to the state of this solve.
+c         On entry ctx holds the problem seen by ctx->fv, ctx->grad
+c            and ctx->hv, or the dense Hessian ctx->A.
+c         On exit ctx->nfev is the number of function evaluations.
+c
 c       n is an integer variable.
 c         On entry n is the number of variables.
 c         On exit n is unchanged.
@@ -97,6 +100,11 @@ c         On entry gqttol specifies the convergence criteria for
 c            subproblems.
 c         On exit gqttol is unchanged.
 c
+c       work is a double precision work array of dimension 2*n*n+14*n
+c         for a dense Hessian, 17*n otherwise.
+c
+c       iwork is an integer work array of dimension n.
+c
 c     **********
 */
 
@@ -106,19 +114,24 @@ c     **********
 	/* Parameters for updating the trust region size delta. */
 	double sigma1 = 0.25, sigma2 = 0.5, sigma3 = 4;
 
-	double p5 = 0.5, one = 1;
 	double gnorm, gnorm0, delta, snorm;
 	double alphac = 1, alpha, f, fc, prered, actred, gs;
-	int search = 1, iter = 1, info, inc = 1;	
-	double *xc = (double *) xmalloc(sizeof(double)*n);
-	double *s = (double *) xmalloc(sizeof(double)*n);
-	double *wa = (double *) xmalloc(sizeof(double)*n); 	
-	double *g = (double *) xmalloc(sizeof(double)*n);
-	double *A = NULL;
+	int search = 1, iter = 1, info, inc = 1, i;	
+	double *xc = work;
+	double *s = work + n;
+	double *wa = work + 2*n;
+	double *g = work + 3*n;
+	struct tron_hess H;
+
+	H.ctx = ctx;
+	H.B = ctx->A;
+	H.L = NULL;
+	H.ind = NULL;
+	H.nfull = n;
+	H.v = H.Hv = NULL;
 
-	uhes(n, x, &A);
-	ugrad(n, x, g);	
-	ufv(n, x, &f);	
+	ctx->fv(ctx, n, x, &f);
+	ctx->grad(ctx, n, x, g);
 	gnorm0 = F77_CALL(dnrm2)(&n, g, &inc);
 	delta = 1000*gnorm0;
 	gnorm = dgpnrm(n, x, xl, xu, g);
@@ -138,11 +151,11 @@ c     **********
 		memcpy(xc, x, sizeof(double)*n);
 		
 		/* Compute the Cauchy step and store in s. */		
-		dcauchy(n, x, xl, xu, A, g, delta, &alphac, s, wa);
+		dcauchy(n, x, xl, xu, &H, g, delta, &alphac, s, wa);
 		
 		/* Compute the projected Newton step. */		
-		dspcg(n, x, xl, xu, A, g, delta, cgtol, s, &info);
-		if (ufv(n, x, &f) > maxfev)
+		dspcg(ctx, n, x, xl, xu, g, delta, cgtol, s, &info, work + 4*n, iwork);
+		if (ctx->fv(ctx, n, x, &f) > maxfev)
 		{
 			/*
 			//printf("ERROR: NFEV > MAXFEV\n");
@@ -152,8 +165,9 @@ c     **********
 		}
 
 		/* Compute the predicted reduction. */
-		memcpy(wa, g, sizeof(double)*n);
-		F77_CALL(dsymv)("U", &n, &p5, A, &n, s, &inc, &one, wa, &inc);
+		dhprod(&H, n, s, wa);
+		for (i=0;i<n;i++)
+			wa[i] = 0.5*wa[i] + g[i];
 		prered = -F77_CALL(ddot)(&n, s, &inc, wa, &inc);
                         
 		/* Compute the actual reduction. */
@@ -204,10 +218,7 @@ c     **********
 		
 			/* Successful iterate. */
 			iter++;
-			/*
-			uhes(n, x, &A);
-			*/
-			ugrad(n, x, g);
+			ctx->grad(ctx, n, x, g);
 			gnorm = dgpnrm(n, x, xl, xu, g);		
 			if (gnorm <= gtol*gnorm0)
         		{
@@ -248,9 +259,4 @@ c     **********
 			continue;
 		}
 	}	
-
-	free(g);
-	free(xc);
-	free(s);
-	free(wa);
 }
@@ -2,8 +2,8 @@
 #include <math.h>
 #include <string.h>
 #include <R_ext/BLAS.h>
+#include "svm.h"
 
-extern void *xmalloc(size_t);
 /* LEVEL 1 BLAS */
 /* extern int daxpy_(int *, double *, double *, int *, double *, int *); */
 /* extern double ddot_(int *, double *, int *, double *, int *); */
@@ -14,15 +14,17 @@ extern void *xmalloc(size_t);
 /* extern int dsymv_(char *, int *, double *, double *, int *, double *, int *, double *, double *, int *); */
 /* MINPACK 2 */
 extern void dtrqsol(int, double *, double *, double , double *);
+extern void dhprod(struct tron_hess *, int, double *, double *);
+extern void dhsolve(struct tron_hess *, char *, int, double *);
 
-void dtrpcg(int n, double *A, double *g, double delta, double *L, double tol, double stol, double *w, int *iters, int *info)
+void dtrpcg(int n, struct tron_hess *H, double *g, double delta, double tol, double stol, double *w, int *iters, int *info, double *wa)
 {
 /*
 c     *********
 c
 c     Subroutine dtrpcg
 c
-c     Given a dense symmetric positive semidefinite matrix A, this
+c     Given a symmetric positive semidefinite matrix A, this
 c     subroutine uses a preconditioned conjugate gradient method to find
 c     an approximate minimizer of the trust region subproblem
 c
@@ -61,9 +63,10 @@ c       n is an integer variable.
 c         On entry n is the number of variables.
 c         On exit n is unchanged.
 c
-c       A is a double precision array of dimension n*n.
-c         On entry A specifies the matrix A.
-c         On exit A is unchanged.
+c       H is a pointer to the Hessian.
+c         On entry H specifies the matrix A and the lower triangular
+c            matrix L of the preconditioner.
+c         On exit H is unchanged.
 c
 c       g is a double precision array of dimension n.
 c         On entry g must contain the vector g.
@@ -73,10 +76,6 @@ c       delta is a double precision variable.
 c         On entry delta is the trust region size.
 c         On exit delta is unchanged.
 c
-c       L is a double precision array of dimension n*n.
-c         On entry L need not to be specified.
-c         On exit the lower triangular part of L contains the matrix L.
-c
 c       tol is a double precision variable.
 c         On entry tol specifies the convergence test
 c            in the un-scaled variables.
@@ -117,16 +116,18 @@ c                       trust region. In this case || w || = delta.
 c
 c             info = 5  Failure to converge within itermax(n) iterations.
 c
+c       wa is a double precision work array of dimension 5*n.
+c
 c     **********
 */
 	int i, inc = 1;
-	double one = 1, zero = 0, alpha, malpha, beta, ptq, rho;
+	double one = 1, alpha, malpha, beta, ptq, rho;
 	double *p, *q, *t, *r, *z, sigma, rtr, rnorm, rnorm0, tnorm;
-	p = (double *) xmalloc(sizeof(double)*n);
-	q = (double *) xmalloc(sizeof(double)*n);
-	t = (double *) xmalloc(sizeof(double)*n);
-	r = (double *) xmalloc(sizeof(double)*n);
-	z = (double *) xmalloc(sizeof(double)*n);
+	p = wa;
+	q = wa + n;
+	t = wa + 2*n;
+	r = wa + 3*n;
+	z = wa + 4*n;
 
 	/* Initialize the iterate w and the residual r.
 	Initialize the residual t of grad q to -g.
@@ -137,7 +138,7 @@ c     **********
 		w[i] = 0;
 		r[i] = t[i] = -g[i];
 	}
-	F77_CALL(dtrsv)("L", "N", "N", &n, L, &n, r, &inc);
+	dhsolve(H, "N", n, r);
 
 	/* Initialize the direction p. */
 	memcpy(p, r, sizeof(double)*n);
@@ -159,13 +160,13 @@ c     **********
 		
 		/* Compute z by solving L'*z = p. */
 		memcpy(z, p, sizeof(double)*n);
-		F77_CALL(dtrsv)("L", "T", "N", &n, L, &n, z, &inc);
+		dhsolve(H, "T", n, z);
 
 		/* Compute q by solving L*q = A*z and save L*q for
 		use in updating the residual t.	*/
-		F77_CALL(dsymv)("U", &n, &one, A, &n, z, &inc, &zero, q, &inc);
+		dhprod(H, n, z, q);
 		memcpy(z, q, sizeof(double)*n);
-		F77_CALL(dtrsv)("L", "N", "N", &n, L, &n, q, &inc);
+		dhsolve(H, "N", n, q);
 		
 		/* Compute alpha and determine sigma such that the trust region
 		constraint || w + sigma*p || = delta is satisfied. */
@@ -220,9 +221,5 @@ c     **********
 	/* iters > itermax = n */
 	*info = 5;
 return0:
-	free(p);
-	free(q);
-	free(r);
-	free(t);
-	free(z);
+	return;
 } 
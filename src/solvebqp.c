@@ -1,43 +1,31 @@
 #include <stdlib.h>
 #include <string.h>
 #include <R_ext/BLAS.h>
+#include "svm.h"
 /* LEVEL 1 BLAS */
 /*extern double ddot_(int *, double *, int *, double *, int *); */
 /* LEVEL 2 BLAS */
 /*extern int dsymv_(char *, int *, double *, double *, int *, double *, int *, double *, double *, int *);*/
 /* MINPACK 2 */
-extern void dtron(int, double *, double *, double *, double, double, double, double, int, double);
+extern void dtron(struct tron_ctx *, int, double *, double *, double *, double, double, double, double, int, double, double *, int *);
 
-struct BQP
-{
-        double eps;
-        int n;
-        double *x, *C, *Q, *p;
-};
-
-int nfev, inc = 1;
-double one = 1, zero = 0, *A, *g0;
-
-int uhes(int n, double *x, double **H)
-{
-	*H = A;
-	return 0;
-}
-int ugrad(int n, double *x, double *g)
+static void ugrad(struct tron_ctx *ctx, int n, double *x, double *g)
 {
 	/* evaluate the gradient g = A*x + g0 */
-	memcpy(g, g0, sizeof(double)*n);
-	F77_CALL(dsymv)("U", &n, &one, A, &n, x, &inc, &one, g, &inc);
-	return 0;
+	int inc = 1;
+	double one = 1;
+	memcpy(g, ctx->g0, sizeof(double)*n);
+	F77_CALL(dsymv)("U", &n, &one, ctx->A, &n, x, &inc, &one, g, &inc);
 }
-int ufv(int n, double *x, double *f)
+static int ufv(struct tron_ctx *ctx, int n, double *x, double *f)
 {
 	/* evaluate the function value f(x) = 0.5*x'*A*x + g0'*x */  
-	double *t = (double *) malloc(sizeof(double)*n);
-	F77_CALL(dsymv)("U", &n, &one, A, &n, x, &inc, &zero, t, &inc);
-	*f = F77_CALL(ddot)(&n, x, &inc, g0, &inc) + 0.5 * F77_CALL(ddot)(&n, x, &inc, t, &inc);
-	free(t);
-	return ++nfev;
+	int inc = 1;
+	double one = 1, zero = 0;
+	double *t = ctx->t;
+	F77_CALL(dsymv)("U", &n, &one, ctx->A, &n, x, &inc, &zero, t, &inc);
+	*f = F77_CALL(ddot)(&n, x, &inc, ctx->g0, &inc) + 0.5 * F77_CALL(ddot)(&n, x, &inc, t, &inc);
+	return ++ctx->nfev;
 }
 
 void solvebqp(struct BQP *qp)
@@ -47,16 +35,24 @@ void solvebqp(struct BQP *qp)
 	int i, n, maxfev;
 	double *x, *xl, *xu;
 	double frtol, fatol, fmin, gtol, cgtol;
+	struct tron_ctx ctx;
 
 	n = qp->n;
 	maxfev = 1000; /* ? */
-	nfev = 0;
+	ctx.fv = ufv;
+	ctx.grad = ugrad;
+	ctx.hv = NULL;
+	ctx.diag = NULL;
+	ctx.prob = NULL;
+	ctx.nfev = 0;
+	ctx.lambda = 1e-3/512/512;
 
 	x = qp->x;
 	xu = qp->C;
-	A = qp->Q;
-	g0 = qp->p;
-	xl = (double *) malloc(sizeof(double)*n);
+	ctx.A = qp->Q;
+	ctx.g0 = qp->p;
+	ctx.t = qp->work;
+	xl = qp->work + n;
 	for (i=0;i<n;i++)
 		xl[i] = 0;
 
@@ -66,7 +62,5 @@ void solvebqp(struct BQP *qp)
 	cgtol = 0.1;	
 	gtol = qp->eps;
 	
-	dtron(n, x, xl, xu, gtol, frtol, fatol, fmin, maxfev, cgtol); 
-
-	free(xl);
+	dtron(&ctx, n, x, xl, xu, gtol, frtol, fatol, fmin, maxfev, cgtol, qp->work + 2*n, qp->iwork); 
 }
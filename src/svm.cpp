@@ -8,7 +8,19 @@
 #include <limits.h>
 #include <stdarg.h>
 #include <cstdio>
+#include <chrono>
 #include "svm.h"
+#include "svmmodel.h"
+// -DKERNLAB_NO_AVX2 leaves only the scalar working set scans, for
+// comparing them in inst/bench/wss.R
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && \
+    !defined(KERNLAB_NO_AVX2)
+#include <immintrin.h>
+#define KERNLAB_HAVE_AVX2 1
+#endif
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 typedef float Qfloat;
 typedef signed char schar;
 #ifndef min
@@ -23,6 +35,14 @@ template <class S, class T> inline void clone(T*& dst, S* src, int n)
 	dst = new T[n];
 	memcpy((void *)dst,(void *)src,sizeof(T)*n);
 }
+template <class T> inline void permute(T*& a, const int *perm, int n)
+{
+	T *b = new T[n];
+	for(int i=0;i<n;i++)
+		b[i] = a[perm[i]];
+	delete[] a;
+	a = b;
+}
 inline double powi(double base, int times)
 {
         double tmp = base, ret = 1.0;
@@ -54,6 +74,526 @@ void info(char *fmt,...) {}
 void info_flush() {}
 #endif
 
+//
+// Solver telemetry
+//
+// Compiled with -DKERNLAB_TELEMETRY (see Makevars) the solvers count
+// their runs, iterations, kernel evaluations, cache hits and misses,
+// shrinking and unshrinking events and the wall clock time spent in
+// working set selection, kernel column fetches, the alpha update and
+// the gradient update, and sample active_size whenever they consider
+// shrinking.  The counters cover one call from R and are returned with
+// its result.  Without the define the TM_* macros expand to nothing.
+//
+#ifdef KERNLAB_TELEMETRY
+enum { TM_RUN, TM_ITER, TM_KERNEL, TM_HIT, TM_MISS, TM_SHRINK, TM_UNSHRINK,
+       TM_SELECT, TM_FETCH, TM_ALPHA, TM_GRADIENT, TM_NR };
+
+static const char *tm_names[TM_NR] = {
+	"runs", "iterations", "kernel.evaluations", "cache.hits",
+	"cache.misses", "shrink", "unshrink", "time.select", "time.fetch",
+	"time.alpha", "time.gradient" };
+
+static struct {
+	double count[TM_NR];
+	int *trace;		// run, iteration, active_size
+	int nr_trace, max_trace;
+} telemetry;
+
+static inline double tm_now()
+{
+	return std::chrono::duration<double>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static inline void tm_add(int what, double v)
+{
+#pragma omp atomic
+	telemetry.count[what] += v;
+}
+
+static void tm_trace(int iter, int active_size)
+{
+#pragma omp critical(telemetry)
+	{
+		if(telemetry.nr_trace == telemetry.max_trace)
+		{
+			telemetry.max_trace = 2*telemetry.max_trace + 64;
+			telemetry.trace = (int *)realloc(telemetry.trace,
+				sizeof(int)*3*telemetry.max_trace);
+		}
+		int *t = telemetry.trace + 3*telemetry.nr_trace++;
+		t[0] = (int)telemetry.count[TM_RUN];
+		t[1] = iter;
+		t[2] = active_size;
+	}
+}
+
+static void tm_reset()
+{
+	for(int k=0;k<TM_NR;k++)
+		telemetry.count[k] = 0;
+	telemetry.nr_trace = 0;
+}
+
+#define TM_COUNT(what,v)	tm_add(what,v)
+#define TM_START(t)		double t = tm_now()
+#define TM_STOP(what,t)		tm_add(what,tm_now()-t)
+#define TM_TRACE(iter,size)	tm_trace(iter,size)
+#define TM_SHRINKING(size,stmt) \
+	{ int tm_size = size; stmt; if(size < tm_size) tm_add(TM_SHRINK,1); }
+#define TM_RESET()		tm_reset()
+#define TM_ATTACH(ans)		set_telemetry(ans)
+#else
+#define TM_COUNT(what,v)
+#define TM_START(t)
+#define TM_STOP(what,t)
+#define TM_TRACE(iter,size)
+#define TM_SHRINKING(size,stmt)	stmt
+#define TM_RESET()
+#define TM_ATTACH(ans)
+#endif
+
+//
+// Working set selection kernels
+//
+// The SMO-type solvers spend most of their time outside the kernel
+// cache scanning the gradient for the maximal violating pair.  Those
+// scans are written here once over plain arrays (gradient, per variable
+// bitmask, diagonal, kernel column) so that an AVX2 version can be
+// selected at run time; the scalar versions are the reference and both
+// return exactly the same indices, ties included.
+//
+// bits of the working set mask kept by Solver for every variable
+enum { WSS_UP = 1, WSS_LOW = 2, WSS_YPOS = 4 };
+
+// storage for the arrays streamed by the scans, aligned to 32 bytes
+template <class T> inline T *aligned_new(int n)
+{
+	char *raw = (char *)malloc(sizeof(T)*n + 32 + sizeof(void *));
+	char *p = raw + sizeof(void *);
+	p += (32 - ((size_t)p & 31)) & 31;
+	((void **)p)[-1] = raw;
+	return (T *)p;
+}
+template <class T> inline void aligned_delete(T *p)
+{
+	if(p) free(((void **)p)[-1]);
+}
+
+static int wss_use_avx2()
+{
+#ifdef KERNLAB_HAVE_AVX2
+	// thread safe initialisation, cascade solves run concurrently
+	static const int has_avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+	return has_avx2;
+#else
+	return 0;
+#endif
+}
+
+// i: maximizes -y_t*G_t over t with (mask[t] & sel) == want
+static int wss_scan_up_scalar(int n, const double *G, const unsigned char *mask,
+			      unsigned char sel, unsigned char want, double &Gmax)
+{
+	int idx = -1;
+	for(int t=0;t<n;t++)
+		if((mask[t] & sel) == want)
+		{
+			double v = (mask[t] & WSS_YPOS) ? -G[t] : G[t];
+			if(v >= Gmax)
+			{
+				Gmax = v;
+				idx = t;
+			}
+		}
+	return idx;
+}
+
+// column i of Q_tj = sign[t]*sign[j]*K(index[t],index[j]), read in place
+// from column index[i] of the kernel matrix K
+struct Q_view
+{
+	const Qfloat *K;
+	const int *index;
+	const schar *sign;
+	schar si;
+	Qfloat operator[](int j) const { return si * sign[j] * K[index[j]]; }
+};
+
+// j: minimizes the second order decrease of the objective over t with
+// (mask[t] & sel) == want, Gmax2 collects max y_t*G_t over the same set
+template <class Column>
+static int wss_scan_low_scalar(int n, const double *G, const unsigned char *mask,
+			       unsigned char sel, unsigned char want, double Gmax,
+			       double QD_i, const double *QD, const Column &Q_i,
+			       double yi2, double &Gmax2, double &obj_diff_min)
+{
+	int idx = -1;
+	for(int j=0;j<n;j++)
+		if((mask[j] & sel) == want)
+		{
+			double yG = (mask[j] & WSS_YPOS) ? G[j] : -G[j];
+			double grad_diff = Gmax + yG;
+			if(yG >= Gmax2)
+				Gmax2 = yG;
+			if(grad_diff > 0)
+			{
+				double obj_diff;
+				double quad_coef = QD_i+QD[j]-((mask[j] & WSS_YPOS) ? yi2 : -yi2)*Q_i[j];
+				if(quad_coef > 0)
+					obj_diff = -(grad_diff*grad_diff)/quad_coef;
+				else
+					obj_diff = -(grad_diff*grad_diff)/TAU;
+				if(obj_diff <= obj_diff_min)
+				{
+					idx = j;
+					obj_diff_min = obj_diff;
+				}
+			}
+		}
+	return idx;
+}
+
+#ifdef KERNLAB_HAVE_AVX2
+__attribute__((target("avx2")))
+static inline __m256i wss_load_mask4(const unsigned char *p)
+{
+	int m;
+	memcpy(&m, p, 4);
+	return _mm256_cvtepu8_epi64(_mm_cvtsi32_si128(m));
+}
+
+__attribute__((target("avx2")))
+static int wss_scan_up_avx2(int n, const double *G, const unsigned char *mask,
+			    unsigned char sel, unsigned char want, double &Gmax)
+{
+	const __m256i vsel = _mm256_set1_epi64x(sel);
+	const __m256i vwant = _mm256_set1_epi64x(want);
+	const __m256i vpos = _mm256_set1_epi64x(WSS_YPOS);
+	const __m256d sign = _mm256_set1_pd(-0.0);
+	const __m256d four = _mm256_set1_pd(4.0);
+	__m256d best = _mm256_set1_pd(Gmax);
+	__m256d best_idx = _mm256_set1_pd(-1.0);
+	__m256d idx = _mm256_set_pd(3.0, 2.0, 1.0, 0.0);
+	int t = 0;
+
+	for(;t+4<=n;t+=4)
+	{
+		__m256i m = wss_load_mask4(mask+t);
+		__m256d cand = _mm256_castsi256_pd(_mm256_cmpeq_epi64(_mm256_and_si256(m, vsel), vwant));
+		__m256d pos = _mm256_castsi256_pd(_mm256_cmpeq_epi64(_mm256_and_si256(m, vpos), vpos));
+		__m256d v = _mm256_xor_pd(_mm256_loadu_pd(G+t), _mm256_and_pd(pos, sign));
+		__m256d upd = _mm256_and_pd(cand, _mm256_cmp_pd(v, best, _CMP_GE_OQ));
+		best = _mm256_blendv_pd(best, v, upd);
+		best_idx = _mm256_blendv_pd(best_idx, idx, upd);
+		idx = _mm256_add_pd(idx, four);
+	}
+
+	// every lane holds its last maximizer, keep the last one overall
+	double bv[4], bi[4];
+	_mm256_storeu_pd(bv, best);
+	_mm256_storeu_pd(bi, best_idx);
+	int out = -1;
+	for(int k=0;k<4;k++)
+		if(bi[k] >= 0 && (bv[k] > Gmax || (bv[k] == Gmax && (int)bi[k] > out)))
+		{
+			Gmax = bv[k];
+			out = (int)bi[k];
+		}
+
+	int tail = wss_scan_up_scalar(n-t, G+t, mask+t, sel, want, Gmax);
+	return tail == -1 ? out : t+tail;
+}
+
+__attribute__((target("avx2")))
+static int wss_scan_low_avx2(int n, const double *G, const unsigned char *mask,
+			     unsigned char sel, unsigned char want, double Gmax,
+			     double QD_i, const double *QD, const Qfloat *Q_i,
+			     double yi2, double &Gmax2, double &obj_diff_min)
+{
+	const __m256i vsel = _mm256_set1_epi64x(sel);
+	const __m256i vwant = _mm256_set1_epi64x(want);
+	const __m256i vpos = _mm256_set1_epi64x(WSS_YPOS);
+	const __m256d sign = _mm256_set1_pd(-0.0);
+	const __m256d zero = _mm256_setzero_pd();
+	const __m256d tau = _mm256_set1_pd(TAU);
+	const __m256d vGmax = _mm256_set1_pd(Gmax);
+	const __m256d vQD_i = _mm256_set1_pd(QD_i);
+	const __m256d vyi2 = _mm256_set1_pd(yi2);
+	const __m256d four = _mm256_set1_pd(4.0);
+	__m256d gmax2 = _mm256_set1_pd(Gmax2);
+	__m256d best = _mm256_set1_pd(obj_diff_min);
+	__m256d best_idx = _mm256_set1_pd(-1.0);
+	__m256d idx = _mm256_set_pd(3.0, 2.0, 1.0, 0.0);
+	int t = 0;
+
+	for(;t+4<=n;t+=4, idx = _mm256_add_pd(idx, four))
+	{
+		__m256i m = wss_load_mask4(mask+t);
+		__m256d cand = _mm256_castsi256_pd(_mm256_cmpeq_epi64(_mm256_and_si256(m, vsel), vwant));
+		if(_mm256_movemask_pd(cand) == 0)
+			continue;
+		__m256d pos = _mm256_castsi256_pd(_mm256_cmpeq_epi64(_mm256_and_si256(m, vpos), vpos));
+		__m256d yG = _mm256_xor_pd(_mm256_loadu_pd(G+t), _mm256_andnot_pd(pos, sign));
+		gmax2 = _mm256_blendv_pd(gmax2, yG, _mm256_and_pd(cand, _mm256_cmp_pd(yG, gmax2, _CMP_GE_OQ)));
+		__m256d grad_diff = _mm256_add_pd(vGmax, yG);
+		__m256d ok = _mm256_and_pd(cand, _mm256_cmp_pd(grad_diff, zero, _CMP_GT_OQ));
+		if(_mm256_movemask_pd(ok) == 0)
+			continue;
+		__m256d q = _mm256_cvtps_pd(_mm_loadu_ps(Q_i+t));
+		__m256d coef = _mm256_blendv_pd(_mm256_xor_pd(vyi2, sign), vyi2, pos);
+		__m256d quad_coef = _mm256_sub_pd(_mm256_add_pd(vQD_i, _mm256_loadu_pd(QD+t)), _mm256_mul_pd(coef, q));
+		quad_coef = _mm256_blendv_pd(tau, quad_coef, _mm256_cmp_pd(quad_coef, zero, _CMP_GT_OQ));
+		__m256d obj_diff = _mm256_div_pd(_mm256_xor_pd(_mm256_mul_pd(grad_diff, grad_diff), sign), quad_coef);
+		__m256d upd = _mm256_and_pd(ok, _mm256_cmp_pd(obj_diff, best, _CMP_LE_OQ));
+		best = _mm256_blendv_pd(best, obj_diff, upd);
+		best_idx = _mm256_blendv_pd(best_idx, idx, upd);
+	}
+
+	double bv[4], bi[4], g2[4];
+	_mm256_storeu_pd(g2, gmax2);
+	for(int k=0;k<4;k++)
+		if(g2[k] >= Gmax2)
+			Gmax2 = g2[k];
+	_mm256_storeu_pd(bv, best);
+	_mm256_storeu_pd(bi, best_idx);
+	int out = -1;
+	for(int k=0;k<4;k++)
+		if(bi[k] >= 0 && (bv[k] < obj_diff_min || (bv[k] == obj_diff_min && (int)bi[k] > out)))
+		{
+			obj_diff_min = bv[k];
+			out = (int)bi[k];
+		}
+
+	const Qfloat *Q_t = Q_i+t;
+	int tail = wss_scan_low_scalar(n-t, G+t, mask+t, sel, want, Gmax,
+				       QD_i, QD+t, Q_t, yi2, Gmax2, obj_diff_min);
+	return tail == -1 ? out : t+tail;
+}
+#endif
+
+static int wss_scan_up(int n, const double *G, const unsigned char *mask,
+		       unsigned char sel, unsigned char want, double &Gmax)
+{
+#ifdef KERNLAB_HAVE_AVX2
+	if(wss_use_avx2())
+		return wss_scan_up_avx2(n, G, mask, sel, want, Gmax);
+#endif
+	return wss_scan_up_scalar(n, G, mask, sel, want, Gmax);
+}
+
+static int wss_scan_low(int n, const double *G, const unsigned char *mask,
+			unsigned char sel, unsigned char want, double Gmax,
+			double QD_i, const double *QD, const Qfloat *Q_i,
+			double yi2, double &Gmax2, double &obj_diff_min)
+{
+#ifdef KERNLAB_HAVE_AVX2
+	if(wss_use_avx2())
+		return wss_scan_low_avx2(n, G, mask, sel, want, Gmax, QD_i, QD, Q_i,
+					 yi2, Gmax2, obj_diff_min);
+#endif
+	return wss_scan_low_scalar(n, G, mask, sel, want, Gmax, QD_i, QD, Q_i,
+				   yi2, Gmax2, obj_diff_min);
+}
+
+static int wss_scan_low(int n, const double *G, const unsigned char *mask,
+			unsigned char sel, unsigned char want, double Gmax,
+			double QD_i, const double *QD, const Q_view &Q_i,
+			double yi2, double &Gmax2, double &obj_diff_min)
+{
+	return wss_scan_low_scalar(n, G, mask, sel, want, Gmax, QD_i, QD, Q_i,
+				   yi2, Gmax2, obj_diff_min);
+}
+
+//
+// Candidate filters for the BSVM working set selection.  The insertion
+// of a candidate into the sorted q/2 sets stays scalar; the AVX2 version
+// only skips blocks of four variables none of which can enter the set.
+// The threshold is re-read before every insertion, so the result is the
+// same as the scalar sweep.
+//
+static inline void bwss_insert_small(double v, int i, double *positive_max,
+				     int *positive_set, int q_2)
+{
+	int j;
+	for (j=1;j<q_2;j++)
+	{
+		if (v >= positive_max[j])
+			break;
+		positive_max[j-1] = positive_max[j];
+		positive_set[j-1] = positive_set[j];
+	}
+	positive_max[j-1] = v;
+	positive_set[j-1] = i;
+}
+
+static inline void bwss_insert_large(double v, int i, double *positive_max,
+				     int *positive_set, int q_2)
+{
+	int j;
+	for (j=1;j<q_2;j++)
+	{
+		if (v <= positive_max[j])
+			break;
+		positive_max[j-1] = positive_max[j];
+		positive_set[j-1] = positive_set[j];
+	}
+	positive_max[j-1] = v;
+	positive_set[j-1] = i;
+}
+
+// free variables with the q_2 smallest |G|
+static inline void bwss_check_free(int i, const double *G, const char *status,
+				   char free_code, double *positive_max,
+				   int *positive_set, int q_2)
+{
+	if (status[i] != free_code) return;
+	double v = fabs(G[i]);
+	if (v < positive_max[0])
+		bwss_insert_small(v, i, positive_max, positive_set, q_2);
+}
+
+// violating variables with the q_2 largest |G|
+static inline void bwss_check_vio(int i, const double *G, const char *status,
+				  char free_code, char upper_code, char lower_code,
+				  double max0, double *positive_max,
+				  int *positive_set, int q_2)
+{
+	double v = fabs(G[i]);
+	if (status[i] == free_code && v <= max0) return;
+	if (status[i] == upper_code)
+	{
+		if (G[i] < 0) return;
+	}
+	else if (status[i] == lower_code)
+	{
+		if (G[i] > 0) return;
+	}
+	if (v > positive_max[0])
+		bwss_insert_large(v, i, positive_max, positive_set, q_2);
+}
+
+static void bwss_scan_free_scalar(int n, const double *G, const char *status,
+				  char free_code, double *positive_max,
+				  int *positive_set, int q_2)
+{
+	for (int i=0;i<n;i++)
+		bwss_check_free(i, G, status, free_code, positive_max, positive_set, q_2);
+}
+
+static void bwss_scan_vio_scalar(int n, const double *G, const char *status,
+				 char free_code, char upper_code, char lower_code,
+				 double max0, double *positive_max,
+				 int *positive_set, int q_2)
+{
+	for (int i=0;i<n;i++)
+		bwss_check_vio(i, G, status, free_code, upper_code, lower_code,
+			       max0, positive_max, positive_set, q_2);
+}
+
+#ifdef KERNLAB_HAVE_AVX2
+__attribute__((target("avx2")))
+static inline __m256d bwss_status_is(const char *status, char code)
+{
+	int m;
+	memcpy(&m, status, 4);
+	__m256i st = _mm256_cvtepi8_epi64(_mm_cvtsi32_si128(m));
+	return _mm256_castsi256_pd(_mm256_cmpeq_epi64(st, _mm256_set1_epi64x(code)));
+}
+
+__attribute__((target("avx2")))
+static void bwss_scan_free_avx2(int n, const double *G, const char *status,
+				char free_code, double *positive_max,
+				int *positive_set, int q_2)
+{
+	const __m256d sign = _mm256_set1_pd(-0.0);
+	int i = 0;
+	for (;i+4<=n;i+=4)
+	{
+		__m256d v = _mm256_andnot_pd(sign, _mm256_loadu_pd(G+i));
+		__m256d c = _mm256_and_pd(bwss_status_is(status+i, free_code),
+			_mm256_cmp_pd(v, _mm256_set1_pd(positive_max[0]), _CMP_LT_OQ));
+		int bits = _mm256_movemask_pd(c);
+		while (bits)
+		{
+			int k = __builtin_ctz(bits);
+			bits &= bits-1;
+			bwss_check_free(i+k, G, status, free_code, positive_max, positive_set, q_2);
+		}
+	}
+	for (;i<n;i++)
+		bwss_check_free(i, G, status, free_code, positive_max, positive_set, q_2);
+}
+
+__attribute__((target("avx2")))
+static void bwss_scan_vio_avx2(int n, const double *G, const char *status,
+			       char free_code, char upper_code, char lower_code,
+			       double max0, double *positive_max,
+			       int *positive_set, int q_2)
+{
+	const __m256d sign = _mm256_set1_pd(-0.0);
+	const __m256d zero = _mm256_setzero_pd();
+	const __m256d vmax0 = _mm256_set1_pd(max0);
+	int i = 0;
+	for (;i+4<=n;i+=4)
+	{
+		__m256d g = _mm256_loadu_pd(G+i);
+		__m256d v = _mm256_andnot_pd(sign, g);
+		__m256d skip = _mm256_and_pd(bwss_status_is(status+i, free_code),
+					     _mm256_cmp_pd(v, vmax0, _CMP_LE_OQ));
+		skip = _mm256_or_pd(skip, _mm256_and_pd(bwss_status_is(status+i, upper_code),
+					     _mm256_cmp_pd(g, zero, _CMP_LT_OQ)));
+		skip = _mm256_or_pd(skip, _mm256_and_pd(bwss_status_is(status+i, lower_code),
+					     _mm256_cmp_pd(g, zero, _CMP_GT_OQ)));
+		__m256d c = _mm256_andnot_pd(skip,
+			_mm256_cmp_pd(v, _mm256_set1_pd(positive_max[0]), _CMP_GT_OQ));
+		int bits = _mm256_movemask_pd(c);
+		while (bits)
+		{
+			int k = __builtin_ctz(bits);
+			bits &= bits-1;
+			bwss_check_vio(i+k, G, status, free_code, upper_code, lower_code,
+				       max0, positive_max, positive_set, q_2);
+		}
+	}
+	for (;i<n;i++)
+		bwss_check_vio(i, G, status, free_code, upper_code, lower_code,
+			       max0, positive_max, positive_set, q_2);
+}
+#endif
+
+static void bwss_scan_free(int n, const double *G, const char *status,
+			   char free_code, double *positive_max,
+			   int *positive_set, int q_2)
+{
+#ifdef KERNLAB_HAVE_AVX2
+	if(wss_use_avx2())
+	{
+		bwss_scan_free_avx2(n, G, status, free_code, positive_max, positive_set, q_2);
+		return;
+	}
+#endif
+	bwss_scan_free_scalar(n, G, status, free_code, positive_max, positive_set, q_2);
+}
+
+static void bwss_scan_vio(int n, const double *G, const char *status,
+			  char free_code, char upper_code, char lower_code,
+			  double max0, double *positive_max,
+			  int *positive_set, int q_2)
+{
+#ifdef KERNLAB_HAVE_AVX2
+	if(wss_use_avx2())
+	{
+		bwss_scan_vio_avx2(n, G, status, free_code, upper_code, lower_code,
+				   max0, positive_max, positive_set, q_2);
+		return;
+	}
+#endif
+	bwss_scan_vio_scalar(n, G, status, free_code, upper_code, lower_code,
+			     max0, positive_max, positive_set, q_2);
+}
+
 //
 // Kernel Cache
 //
@@ -125,8 +665,10 @@ int Cache::get_data(const int index, Qfloat **data, int len)
 	if(h->len) lru_delete(h);
 	int more = len - h->len;
 
+	TM_COUNT(more > 0 ? TM_MISS : TM_HIT, 1);
 	if(more > 0)
 	{
+		TM_COUNT(TM_KERNEL, more);
 		// free old space
 		while(size < more)
 		{
@@ -190,8 +732,19 @@ void Cache::swap_index(int i, int j)
 class QMatrix {
 public:
 	virtual Qfloat *get_Q(int column, int len) const = 0;
+	// several distinct columns at once, all valid until the next get_Q
+	virtual void get_Q_batch(const int *column, int n, int len, const Qfloat **out) const
+	{
+		for(int k=0;k<n;k++)
+			out[k] = get_Q(column[k],len);
+	}
 	virtual double *get_QD() const = 0;
 	virtual void swap_index(int i, int j) const = 0;
+	// a Q with Q_ij = sign[i]*sign[j]*K(index[i],index[j]) for a kernel
+	// matrix K returns the order of K, index and sign, and get_K gives
+	// column index[i] of K without copying; 0 and NULL otherwise
+	virtual int get_index(const int **index, const schar **sign) const { return 0; }
+	virtual const Qfloat *get_K(int i) const { return NULL; }
 	virtual ~QMatrix() {}
 };
 
@@ -290,9 +843,10 @@ private:
 	  return result;
 	}
   
+        // x[i] holds the row of example i in the m x m matrix K
         double kernel_R(int i, int j) const
         {   
-	          return *(K + m*i +j);
+	          return K[(size_t) m * (int) x[i]->value + (int) x[j]->value];
         }
 };
 
@@ -460,6 +1014,100 @@ double Kernel::k_function(const svm_node *x, const svm_node *y,
 	}
 }
 
+//
+// Training budget of one call into the solvers: a limit on the
+// iterations summed over all solver runs, a wall clock limit and user
+// interrupts.  Solvers poll() it whenever they consider shrinking, so
+// the inner loop pays nothing for it, and spend() their iterations and
+// the reason they stopped on exit.  Once exhausted every further
+// solver run returns at once with its current, feasible alpha.  A
+// solver that stops at its own iteration cap rather than the budget
+// reports SOLVE_MAX_EPOCHS, which does not stop the runs that follow.
+//
+enum { SOLVE_CONVERGED, SOLVE_MAX_ITER, SOLVE_MAX_TIME, SOLVE_INTERRUPTED,
+       SOLVE_MAX_EPOCHS };
+
+static bool user_interrupt();
+
+class Budget {
+public:
+	Budget(double max_iter, double max_time)
+	:max_iter(max_iter), max_time(max_time), iter(0)
+	{
+		status = SOLVE_CONVERGED;
+		capped = false;
+		master_polls = false;
+		start = std::chrono::steady_clock::now();
+	}
+
+	// iterations the next solver run may spend
+	int iter_left()
+	{
+		double left;
+#pragma omp critical(budget)
+		left = (status == SOLVE_CONVERGED)? max_iter - iter : 0;
+		return (int)max(0.0, min(left, (double)INT_MAX));
+	}
+
+	int poll()
+	{
+		int ret;
+		double t = std::chrono::duration<double>(
+			std::chrono::steady_clock::now() - start).count();
+#pragma omp critical(budget)
+		{
+			if(status == SOLVE_CONVERGED && t > max_time)
+				status = SOLVE_MAX_TIME;
+			ret = status;
+		}
+		// the R API may only be used from the thread R runs on, the
+		// master of an outermost parallel region after poll_on_master()
+#ifdef _OPENMP
+		if(omp_in_parallel() && !(master_polls && omp_get_level() == 1 &&
+					  omp_get_thread_num() == 0))
+			return ret;
+#endif
+		if(ret == SOLVE_CONVERGED && user_interrupt())
+		{
+#pragma omp critical(budget)
+			status = SOLVE_INTERRUPTED;
+			ret = SOLVE_INTERRUPTED;
+		}
+		return ret;
+	}
+
+	// let the master thread check for user interrupts inside the
+	// parallel region the caller opens, so that the runs of all threads
+	// stop on an interrupt
+	void poll_on_master() { master_polls = true; }
+
+	void spend(int iter, int why)
+	{
+#pragma omp critical(budget)
+		{
+			this->iter += iter;
+			if(why == SOLVE_MAX_EPOCHS)
+				capped = true;
+			else if(status == SOLVE_CONVERGED)
+				status = why;
+		}
+	}
+
+	// the status to report for the whole call
+	int result() const
+	{
+		return (status == SOLVE_CONVERGED && capped)? SOLVE_MAX_EPOCHS : status;
+	}
+
+	double spent() const { return iter; }
+
+	int status;
+private:
+	bool capped, master_polls;
+	double max_iter, max_time, iter;
+	std::chrono::steady_clock::time_point start;
+};
+
 // Generalized SMO+SVMlight algorithm
 // Solves:
 //
@@ -480,7 +1128,7 @@ double Kernel::k_function(const svm_node *x, const svm_node *y,
 //
 class Solver {
 public:
-	Solver() {};
+	Solver(Budget *budget_ = NULL) { budget = budget_; };
 	virtual ~Solver() {};
 
 	struct SolutionInfo {
@@ -493,13 +1141,14 @@ public:
 
 	void Solve(int l, const QMatrix& Q, const double *p_, const schar *y_,
 		   double *alpha_, double Cp, double Cn, double eps,
-		   SolutionInfo* si, int shrinking);
+		   SolutionInfo* si, int shrinking, int npairs = 1);
 protected:
 	int active_size;
 	schar *y;
 	double *G;		// gradient of objective function
 	enum { LOWER_BOUND, UPPER_BOUND, FREE };
 	char *alpha_status;	// LOWER_BOUND, UPPER_BOUND, FREE
+	unsigned char *mask;	// WSS_UP, WSS_LOW, WSS_YPOS bits
 	double *alpha;
 	const QMatrix *Q;
 	const double *QD;
@@ -511,10 +1160,30 @@ protected:
 	int l;
 	bool unshrink;	// XXX
 
+	Budget *budget;
+
+	// parallel SMO: several disjoint pairs per iteration
+	int npairs;
+	int *pair_set;
+	double *pair_G;
+	double *pair_delta;
+	const Qfloat **pair_Q;
+
+	// Q given through a kernel matrix of order K_l (SVR), see get_index
+	int K_l;
+	const int *K_index;
+	const schar *K_sign;
+	double *K_delta;	// K_l doubles, change of G per column of K
+
 	double get_C(int i)
 	{
 		return (y[i] > 0)? Cp : Cn;
 	}
+	Q_view get_Q_view(int i) const
+	{
+		Q_view v = { Q->get_K(i), K_index, K_sign, K_sign[i] };
+		return v;
+	}
 	void update_alpha_status(int i)
 	{
 		if(alpha[i] >= get_C(i))
@@ -522,12 +1191,31 @@ protected:
 		else if(alpha[i] <= 0)
 			alpha_status[i] = LOWER_BOUND;
 		else alpha_status[i] = FREE;
+
+		// membership of I_up(\alpha) and I_low(\alpha)
+		unsigned char m = 0;
+		if(y[i]==+1)
+		{
+			m = WSS_YPOS;
+			if(alpha_status[i] != UPPER_BOUND) m |= WSS_UP;
+			if(alpha_status[i] != LOWER_BOUND) m |= WSS_LOW;
+		}
+		else
+		{
+			if(alpha_status[i] != LOWER_BOUND) m |= WSS_UP;
+			if(alpha_status[i] != UPPER_BOUND) m |= WSS_LOW;
+		}
+		mask[i] = m;
 	}
 	bool is_upper_bound(int i) { return alpha_status[i] == UPPER_BOUND; }
 	bool is_lower_bound(int i) { return alpha_status[i] == LOWER_BOUND; }
 	bool is_free(int i) { return alpha_status[i] == FREE; }
 	void swap_index(int i, int j);
 	void reconstruct_gradient();
+	void solve_pair(int i, int j, double Q_ij);
+	void update_pairs(int i, int j);
+	void update_gradient(const Q_view &Q_i, double d_i, const Q_view &Q_j, double d_j);
+	void update_G_bar(int i, double c);
 	virtual int select_working_set(int &i, int &j);
 	virtual double calculate_rho();
 	virtual void do_shrinking();
@@ -541,6 +1229,7 @@ void Solver::swap_index(int i, int j)
 	swap(y[i],y[j]);
 	swap(G[i],G[j]);
 	swap(alpha_status[i],alpha_status[j]);
+	swap(mask[i],mask[j]);
 	swap(alpha[i],alpha[j]);
 	swap(p[i],p[j]);
 	swap(active_set[i],active_set[j]);
@@ -552,6 +1241,7 @@ void Solver::reconstruct_gradient()
 	// reconstruct inactive elements of G from G_bar and free variables
 
 	if(active_size == l) return;
+	TM_COUNT(TM_UNSHRINK, 1);
 
 	int i,j;
 	int nr_free = 0;
@@ -589,7 +1279,7 @@ void Solver::reconstruct_gradient()
 
 void Solver::Solve(int l, const QMatrix& Q, const double *p_, const schar *y_,
 		   double *alpha_, double Cp, double Cn, double eps,
-		   SolutionInfo* si, int shrinking)
+		   SolutionInfo* si, int shrinking, int npairs)
 {
 	this->l = l;
 	this->Q = &Q;
@@ -600,11 +1290,15 @@ void Solver::Solve(int l, const QMatrix& Q, const double *p_, const schar *y_,
 	this->Cp = Cp;
 	this->Cn = Cn;
 	this->eps = eps;
+	this->npairs = npairs;
 	unshrink = false;
+	K_l = Q.get_index(&K_index, &K_sign);
+	K_delta = K_l ? new double[K_l] : NULL;
 
 	// initialize alpha_status
 	{
 		alpha_status = new char[l];
+		mask = aligned_new<unsigned char>(l);
 		for(int i=0;i<l;i++)
 			update_alpha_status(i);
 	}
@@ -619,7 +1313,7 @@ void Solver::Solve(int l, const QMatrix& Q, const double *p_, const schar *y_,
 
 	// initialize gradient
 	{
-		G = new double[l];
+		G = aligned_new<double>(l);
 		G_bar = new double[l];
 		int i;
 		for(i=0;i<l;i++)
@@ -641,11 +1335,24 @@ void Solver::Solve(int l, const QMatrix& Q, const double *p_, const schar *y_,
 			}
 	}
 
+	if(npairs > 1)
+	{
+		pair_set = new int[2*npairs];
+		pair_G = new double[2*npairs];
+		pair_delta = new double[2*npairs];
+		pair_Q = new const Qfloat *[2*npairs];
+	}
+
 	// optimization step
 
 	int iter = 0;
-	int max_iter = max(10000000, l>INT_MAX/100 ? INT_MAX : 100*l);
+	const int own_max_iter = max(10000000, l>INT_MAX/100 ? INT_MAX : 100*l);
+	int max_iter = own_max_iter;
 	int counter = min(l,1000)+1;
+	int status = SOLVE_CONVERGED;
+	if(budget)
+		max_iter = min(max_iter, budget->iter_left());
+	TM_COUNT(TM_RUN, 1);
 	
 	while(iter < max_iter)
 	{
@@ -654,10 +1361,14 @@ void Solver::Solve(int l, const QMatrix& Q, const double *p_, const schar *y_,
 		if(--counter == 0)
 		{
 			counter = min(l,1000);
-			if(shrinking) do_shrinking();
+			if(shrinking) TM_SHRINKING(active_size, do_shrinking());
+			TM_TRACE(iter, active_size);
+			if(budget && (status = budget->poll()) != SOLVE_CONVERGED)
+				break;
 		}
 
 		int i,j;
+		TM_START(t_select);
 		if(select_working_set(i,j)!=0)
 		{
 			// reconstruct the whole gradient
@@ -670,13 +1381,32 @@ void Solver::Solve(int l, const QMatrix& Q, const double *p_, const schar *y_,
 			else
 				counter = 1;	// do shrinking next iteration
 		}
+		TM_STOP(TM_SELECT, t_select);
 		
 		++iter;
 
+		if(npairs > 1)
+		{
+			update_pairs(i,j);
+			continue;
+		}
+
 		// update alpha[i] and alpha[j], handle bounds carefully
 		
-		const Qfloat *Q_i = Q.get_Q(i,active_size);
-		const Qfloat *Q_j = Q.get_Q(j,active_size);
+		TM_START(t_fetch);
+		const Qfloat *Q_i = NULL, *Q_j = NULL;
+		Q_view K_i, K_j;
+		if(K_l)
+		{
+			K_i = get_Q_view(i);
+			K_j = get_Q_view(j);
+		}
+		else
+		{
+			Q_i = Q.get_Q(i,active_size);
+			Q_j = Q.get_Q(j,active_size);
+		}
+		TM_STOP(TM_FETCH, t_fetch);
 
 		double C_i = get_C(i);
 		double C_j = get_C(j);
@@ -684,102 +1414,23 @@ void Solver::Solve(int l, const QMatrix& Q, const double *p_, const schar *y_,
 		double old_alpha_i = alpha[i];
 		double old_alpha_j = alpha[j];
 
-		if(y[i]!=y[j])
-		{
-			double quad_coef = QD[i]+QD[j]+2*Q_i[j];
-			if (quad_coef <= 0)
-				quad_coef = TAU;
-			double delta = (-G[i]-G[j])/quad_coef;
-			double diff = alpha[i] - alpha[j];
-			alpha[i] += delta;
-			alpha[j] += delta;
-			
-			if(diff > 0)
-			{
-				if(alpha[j] < 0)
-				{
-					alpha[j] = 0;
-					alpha[i] = diff;
-				}
-			}
-			else
-			{
-				if(alpha[i] < 0)
-				{
-					alpha[i] = 0;
-					alpha[j] = -diff;
-				}
-			}
-			if(diff > C_i - C_j)
-			{
-				if(alpha[i] > C_i)
-				{
-					alpha[i] = C_i;
-					alpha[j] = C_i - diff;
-				}
-			}
-			else
-			{
-				if(alpha[j] > C_j)
-				{
-					alpha[j] = C_j;
-					alpha[i] = C_j + diff;
-				}
-			}
-		}
+		TM_START(t_alpha);
+		solve_pair(i,j,K_l ? K_i[j] : Q_i[j]);
+		TM_STOP(TM_ALPHA, t_alpha);
+
+		// update G
+
+		TM_START(t_gradient);
+		double delta_alpha_i = alpha[i] - old_alpha_i;
+		double delta_alpha_j = alpha[j] - old_alpha_j;
+		
+		if(K_l)
+			update_gradient(K_i, delta_alpha_i, K_j, delta_alpha_j);
 		else
-		{
-			double quad_coef = QD[i]+QD[j]-2*Q_i[j];
-			if (quad_coef <= 0)
-				quad_coef = TAU;
-			double delta = (G[i]-G[j])/quad_coef;
-			double sum = alpha[i] + alpha[j];
-			alpha[i] -= delta;
-			alpha[j] += delta;
-
-			if(sum > C_i)
-			{
-				if(alpha[i] > C_i)
-				{
-					alpha[i] = C_i;
-					alpha[j] = sum - C_i;
-				}
-			}
-			else
-			{
-				if(alpha[j] < 0)
-				{
-					alpha[j] = 0;
-					alpha[i] = sum;
-				}
-			}
-			if(sum > C_j)
+			for(int k=0;k<active_size;k++)
 			{
-				if(alpha[j] > C_j)
-				{
-					alpha[j] = C_j;
-					alpha[i] = sum - C_j;
-				}
+				G[k] += Q_i[k]*delta_alpha_i + Q_j[k]*delta_alpha_j;
 			}
-			else
-			{
-				if(alpha[i] < 0)
-				{
-					alpha[i] = 0;
-					alpha[j] = sum;
-				}
-			}
-		}
-
-		// update G
-
-		double delta_alpha_i = alpha[i] - old_alpha_i;
-		double delta_alpha_j = alpha[j] - old_alpha_j;
-		
-		for(int k=0;k<active_size;k++)
-		{
-			G[k] += Q_i[k]*delta_alpha_i + Q_j[k]*delta_alpha_j;
-		}
 
 		// update alpha_status and G_bar
 
@@ -788,32 +1439,18 @@ void Solver::Solve(int l, const QMatrix& Q, const double *p_, const schar *y_,
 			bool uj = is_upper_bound(j);
 			update_alpha_status(i);
 			update_alpha_status(j);
-			int k;
 			if(ui != is_upper_bound(i))
-			{
-				Q_i = Q.get_Q(i,l);
-				if(ui)
-					for(k=0;k<l;k++)
-						G_bar[k] -= C_i * Q_i[k];
-				else
-					for(k=0;k<l;k++)
-						G_bar[k] += C_i * Q_i[k];
-			}
-
+				update_G_bar(i, ui ? -C_i : C_i);
 			if(uj != is_upper_bound(j))
-			{
-				Q_j = Q.get_Q(j,l);
-				if(uj)
-					for(k=0;k<l;k++)
-						G_bar[k] -= C_j * Q_j[k];
-				else
-					for(k=0;k<l;k++)
-						G_bar[k] += C_j * Q_j[k];
-			}
+				update_G_bar(j, uj ? -C_j : C_j);
 		}
+		TM_STOP(TM_GRADIENT, t_gradient);
 	}
+	TM_COUNT(TM_ITER, iter);
 
 	if(iter >= max_iter)
+		status = (max_iter < own_max_iter)? SOLVE_MAX_ITER : SOLVE_MAX_EPOCHS;
+	if(status != SOLVE_CONVERGED)
 	{
 		if(active_size < l)
 		{
@@ -823,6 +1460,8 @@ void Solver::Solve(int l, const QMatrix& Q, const double *p_, const schar *y_,
 			
 		}
 	}
+	if(budget)
+		budget->spend(iter, status);
 
 	// calculate rho
 
@@ -860,107 +1499,277 @@ void Solver::Solve(int l, const QMatrix& Q, const double *p_, const schar *y_,
 	delete[] y;
 	delete[] alpha;
 	delete[] alpha_status;
+	aligned_delete(mask);
 	delete[] active_set;
-	delete[] G;
+	aligned_delete(G);
 	delete[] G_bar;
+	delete[] K_delta;
+	if(npairs > 1)
+	{
+		delete[] pair_set;
+		delete[] pair_G;
+		delete[] pair_delta;
+		delete[] pair_Q;
+	}
 }
 
-// return 1 if already optimal, return 0 otherwise
-int Solver::select_working_set(int &out_i, int &out_j)
+// G += Q_i*d_i + Q_j*d_j over the active set for Q given through a kernel
+// matrix K.  The variables on one column of K (alpha and alpha* of a
+// sample in SVR) change by the same amount up to sign, so with most of
+// them active it is computed once per column of K.
+void Solver::update_gradient(const Q_view &Q_i, double d_i, const Q_view &Q_j, double d_j)
 {
-	// return i,j such that
-	// i: maximizes -y_i * grad(f)_i, i in I_up(\alpha)
-	// j: minimizes the decrease of obj value
-	//    (if quadratic coefficeint <= 0, replace it with tau)
-	//    -y_j*grad(f)_j < -y_i*grad(f)_i, j in I_low(\alpha)
-	
-	double Gmax = -INF;
-	double Gmax2 = -INF;
-	int Gmax_idx = -1;
-	int Gmin_idx = -1;
-	double obj_diff_min = INF;
+	const Qfloat *K_i = Q_i.K, *K_j = Q_j.K;
+	const int *index = K_index;
+	const schar *sign = K_sign;
+	double c_i = Q_i.si*d_i, c_j = Q_j.si*d_j;
+	int k;
 
-	for(int t=0;t<active_size;t++)
-		if(y[t]==+1)	
+	if(active_size > K_l)
+	{
+		double *t = K_delta;
+		for(k=0;k<K_l;k++)
+			t[k] = K_i[k]*c_i + K_j[k]*c_j;
+		for(k=0;k<active_size;k++)
+			G[k] += sign[k]*t[index[k]];
+	}
+	else
+		for(k=0;k<active_size;k++)
+			G[k] += sign[k]*(K_i[index[k]]*c_i + K_j[index[k]]*c_j);
+}
+
+// G_bar += c*Q_i over all variables
+void Solver::update_G_bar(int i, double c)
+{
+	int k;
+	if(K_l)
+	{
+		const Qfloat *K_i = Q->get_K(i);
+		double *t = K_delta;
+		c *= K_sign[i];
+		for(k=0;k<K_l;k++)
+			t[k] = K_i[k]*c;
+		for(k=0;k<l;k++)
+			G_bar[k] += K_sign[k]*t[K_index[k]];
+	}
+	else
+	{
+		const Qfloat *Q_i = Q->get_Q(i,l);
+		for(k=0;k<l;k++)
+			G_bar[k] += c * Q_i[k];
+	}
+}
+
+// two-variable subproblem on alpha[i], alpha[j] with the current gradient
+void Solver::solve_pair(int i, int j, double Q_ij)
+{
+	double C_i = get_C(i);
+	double C_j = get_C(j);
+
+	if(y[i]!=y[j])
+	{
+		double quad_coef = QD[i]+QD[j]+2*Q_ij;
+		if (quad_coef <= 0)
+			quad_coef = TAU;
+		double delta = (-G[i]-G[j])/quad_coef;
+		double diff = alpha[i] - alpha[j];
+		alpha[i] += delta;
+		alpha[j] += delta;
+		
+		if(diff > 0)
 		{
-			if(!is_upper_bound(t))
-				if(-G[t] >= Gmax)
-				{
-					Gmax = -G[t];
-					Gmax_idx = t;
-				}
+			if(alpha[j] < 0)
+			{
+				alpha[j] = 0;
+				alpha[i] = diff;
+			}
 		}
 		else
 		{
-			if(!is_lower_bound(t))
-				if(G[t] >= Gmax)
-				{
-					Gmax = G[t];
-					Gmax_idx = t;
-				}
+			if(alpha[i] < 0)
+			{
+				alpha[i] = 0;
+				alpha[j] = -diff;
+			}
 		}
-
-	int i = Gmax_idx;
-	const Qfloat *Q_i = NULL;
-	if(i != -1) // NULL Q_i not accessed: Gmax=-INF if i=-1
-		Q_i = Q->get_Q(i,active_size);
-
-	for(int j=0;j<active_size;j++)
+		if(diff > C_i - C_j)
+		{
+			if(alpha[i] > C_i)
+			{
+				alpha[i] = C_i;
+				alpha[j] = C_i - diff;
+			}
+		}
+		else
+		{
+			if(alpha[j] > C_j)
+			{
+				alpha[j] = C_j;
+				alpha[i] = C_j + diff;
+			}
+		}
+	}
+	else
 	{
-		if(y[j]==+1)
+		double quad_coef = QD[i]+QD[j]-2*Q_ij;
+		if (quad_coef <= 0)
+			quad_coef = TAU;
+		double delta = (G[i]-G[j])/quad_coef;
+		double sum = alpha[i] + alpha[j];
+		alpha[i] -= delta;
+		alpha[j] += delta;
+
+		if(sum > C_i)
 		{
-			if (!is_lower_bound(j))
+			if(alpha[i] > C_i)
 			{
-				double grad_diff=Gmax+G[j];
-				if (G[j] >= Gmax2)
-					Gmax2 = G[j];
-				if (grad_diff > 0)
-				{
-					double obj_diff; 
-					double quad_coef = QD[i]+QD[j]-2.0*y[i]*Q_i[j];
-					if (quad_coef > 0)
-						obj_diff = -(grad_diff*grad_diff)/quad_coef;
-					else
-						obj_diff = -(grad_diff*grad_diff)/TAU;
-
-					if (obj_diff <= obj_diff_min)
-					{
-						Gmin_idx=j;
-						obj_diff_min = obj_diff;
-					}
-				}
+				alpha[i] = C_i;
+				alpha[j] = sum - C_i;
 			}
 		}
 		else
 		{
-			if (!is_upper_bound(j))
+			if(alpha[j] < 0)
 			{
-				double grad_diff= Gmax-G[j];
-				if (-G[j] >= Gmax2)
-					Gmax2 = -G[j];
-				if (grad_diff > 0)
-				{
-					double obj_diff; 
-					double quad_coef = QD[i]+QD[j]+2.0*y[i]*Q_i[j];
-					if (quad_coef > 0)
-						obj_diff = -(grad_diff*grad_diff)/quad_coef;
-					else
-						obj_diff = -(grad_diff*grad_diff)/TAU;
-
-					if (obj_diff <= obj_diff_min)
-					{
-						Gmin_idx=j;
-						obj_diff_min = obj_diff;
-					}
-				}
+				alpha[j] = 0;
+				alpha[i] = sum;
+			}
+		}
+		if(sum > C_j)
+		{
+			if(alpha[j] > C_j)
+			{
+				alpha[j] = C_j;
+				alpha[i] = sum - C_j;
+			}
+		}
+		else
+		{
+			if(alpha[i] < 0)
+			{
+				alpha[i] = 0;
+				alpha[j] = sum;
 			}
 		}
 	}
+}
+
+// Take the maximal violating pair (i,j) and up to npairs-1 further
+// disjoint pairs chosen the same way among the remaining variables.
+// The pairs are solved one after another, keeping the gradient of the
+// working set exact in between, so every step decreases the objective
+// as in plain SMO; the rest of the gradient is then updated in a single
+// pass over all fetched columns.
+void Solver::update_pairs(int i, int j)
+{
+	int k, m, n = 2;
+	pair_set[0] = i;
+	pair_set[1] = j;
+	mask[i] = mask[j] = 0;	// restored by update_alpha_status below
+
+	TM_START(t_select);
+	while(n < 2*npairs)
+	{
+		double Gmax = -INF;
+		double Gmax2 = -INF;
+		double obj_diff_min = INF;
+		int ii = wss_scan_up(active_size, G, mask, WSS_UP, WSS_UP, Gmax);
+		if(ii == -1)
+			break;
+		const Qfloat *Q_ii = Q->get_Q(ii,active_size);
+		int jj = wss_scan_low(active_size, G, mask, WSS_LOW, WSS_LOW, Gmax,
+				      QD[ii], QD, Q_ii, 2.0*y[ii], Gmax2, obj_diff_min);
+		if(jj == -1 || Gmax+Gmax2 < eps)
+			break;
+		pair_set[n++] = ii;
+		pair_set[n++] = jj;
+		mask[ii] = mask[jj] = 0;
+	}
+	TM_STOP(TM_SELECT, t_select);
+
+	TM_START(t_fetch);
+	Q->get_Q_batch(pair_set, n, active_size, pair_Q);
+	TM_STOP(TM_FETCH, t_fetch);
+
+	TM_START(t_alpha);
+	for(k=0;k<n;k++)
+		pair_G[k] = G[pair_set[k]];
+
+	for(m=0;m<n;m+=2)
+	{
+		int a = pair_set[m], b = pair_set[m+1];
+		double old_alpha_a = alpha[a];
+		double old_alpha_b = alpha[b];
+		solve_pair(a,b,pair_Q[m][b]);
+		double da = alpha[a] - old_alpha_a;
+		double db = alpha[b] - old_alpha_b;
+		pair_delta[m] = da;
+		pair_delta[m+1] = db;
+		for(k=m+2;k<n;k++)
+			G[pair_set[k]] += pair_Q[m][pair_set[k]]*da + pair_Q[m+1][pair_set[k]]*db;
+	}
+
+	for(k=0;k<n;k++)
+		G[pair_set[k]] = pair_G[k];
+	TM_STOP(TM_ALPHA, t_alpha);
+
+	// update G
+
+	TM_START(t_gradient);
+	const Qfloat **Qs = pair_Q;
+	const double *delta = pair_delta;
+	int nn = n;
+#pragma omp parallel for schedule(static)
+	for(int t=0;t<active_size;t++)
+	{
+		double s = 0;
+		for(int mm=0;mm<nn;mm++)
+			s += Qs[mm][t]*delta[mm];
+		G[t] += s;
+	}
+
+	// update alpha_status and G_bar
+
+	for(k=0;k<n;k++)
+	{
+		int a = pair_set[k];
+		bool u = is_upper_bound(a);
+		update_alpha_status(a);
+		if(u != is_upper_bound(a))
+			update_G_bar(a, u ? -get_C(a) : get_C(a));
+	}
+	TM_STOP(TM_GRADIENT, t_gradient);
+}
+
+// return 1 if already optimal, return 0 otherwise
+int Solver::select_working_set(int &out_i, int &out_j)
+{
+	// return i,j such that
+	// i: maximizes -y_i * grad(f)_i, i in I_up(\alpha)
+	// j: minimizes the decrease of obj value
+	//    (if quadratic coefficeint <= 0, replace it with tau)
+	//    -y_j*grad(f)_j < -y_i*grad(f)_i, j in I_low(\alpha)
+	
+	double Gmax = -INF;
+	double Gmax2 = -INF;
+	double obj_diff_min = INF;
+
+	int i = wss_scan_up(active_size, G, mask, WSS_UP, WSS_UP, Gmax);
+	if(i == -1) // I_up is empty: Gmax = -INF
+		return 1;
+
+	int Gmin_idx;
+	if(K_l)
+		Gmin_idx = wss_scan_low(active_size, G, mask, WSS_LOW, WSS_LOW, Gmax,
+					QD[i], QD, get_Q_view(i), 2.0*y[i], Gmax2, obj_diff_min);
+	else
+		Gmin_idx = wss_scan_low(active_size, G, mask, WSS_LOW, WSS_LOW, Gmax,
+					QD[i], QD, Q->get_Q(i,active_size), 2.0*y[i], Gmax2, obj_diff_min);
 
 	if(Gmax+Gmax2 < eps)
 		return 1;
 
-	out_i = Gmax_idx;
+	out_i = i;
 	out_j = Gmin_idx;
 	return 0;
 }
@@ -1091,7 +1900,7 @@ double Solver::calculate_rho()
 class Solver_NU: public Solver
 {
 public:
-	Solver_NU() {}
+	Solver_NU(Budget *budget_ = NULL): Solver(budget_) {}
 	void Solve(int l, const QMatrix& Q, const double *p, const schar *y,
 		   double *alpha, double Cp, double Cn, double eps,
 		   SolutionInfo* si, int shrinking)
@@ -1118,103 +1927,53 @@ int Solver_NU::select_working_set(int &out_i, int &out_j)
 
 	double Gmaxp = -INF;
 	double Gmaxp2 = -INF;
-	int Gmaxp_idx = -1;
+	double obj_diffp_min = INF;
+	int Gminp_idx = -1;
 
 	double Gmaxn = -INF;
 	double Gmaxn2 = -INF;
-	int Gmaxn_idx = -1;
+	double obj_diffn_min = INF;
+	int Gminn_idx = -1;
 
-	int Gmin_idx = -1;
-	double obj_diff_min = INF;
+	int ip = wss_scan_up(active_size, G, mask, WSS_UP|WSS_YPOS, WSS_UP|WSS_YPOS, Gmaxp);
+	int in = wss_scan_up(active_size, G, mask, WSS_UP|WSS_YPOS, WSS_UP, Gmaxn);
 
-	for(int t=0;t<active_size;t++)
-		if(y[t]==+1)
-		{
-			if(!is_upper_bound(t))
-				if(-G[t] >= Gmaxp)
-				{
-					Gmaxp = -G[t];
-					Gmaxp_idx = t;
-				}
-		}
+	// Gmaxp=-INF if ip=-1 and Gmaxn=-INF if in=-1, the pair is never chosen
+	if(ip != -1)
+	{
+		if(K_l)
+			Gminp_idx = wss_scan_low(active_size, G, mask, WSS_LOW|WSS_YPOS, WSS_LOW|WSS_YPOS,
+						 Gmaxp, QD[ip], QD, get_Q_view(ip), 2.0, Gmaxp2, obj_diffp_min);
 		else
-		{
-			if(!is_lower_bound(t))
-				if(G[t] >= Gmaxn)
-				{
-					Gmaxn = G[t];
-					Gmaxn_idx = t;
-				}
-		}
-
-	int ip = Gmaxp_idx;
-	int in = Gmaxn_idx;
-	const Qfloat *Q_ip = NULL;
-	const Qfloat *Q_in = NULL;
-	if(ip != -1) // NULL Q_ip not accessed: Gmaxp=-INF if ip=-1
-		Q_ip = Q->get_Q(ip,active_size);
+			Gminp_idx = wss_scan_low(active_size, G, mask, WSS_LOW|WSS_YPOS, WSS_LOW|WSS_YPOS,
+						 Gmaxp, QD[ip], QD, Q->get_Q(ip,active_size), 2.0, Gmaxp2, obj_diffp_min);
+	}
 	if(in != -1)
-		Q_in = Q->get_Q(in,active_size);
-
-	for(int j=0;j<active_size;j++)
 	{
-		if(y[j]==+1)
-		{
-			if (!is_lower_bound(j))	
-			{
-				double grad_diff=Gmaxp+G[j];
-				if (G[j] >= Gmaxp2)
-					Gmaxp2 = G[j];
-				if (grad_diff > 0)
-				{
-					double obj_diff; 
-					double quad_coef = QD[ip]+QD[j]-2*Q_ip[j];
-					if (quad_coef > 0)
-						obj_diff = -(grad_diff*grad_diff)/quad_coef;
-					else
-						obj_diff = -(grad_diff*grad_diff)/TAU;
-
-					if (obj_diff <= obj_diff_min)
-					{
-						Gmin_idx=j;
-						obj_diff_min = obj_diff;
-					}
-				}
-			}
-		}
+		if(K_l)
+			Gminn_idx = wss_scan_low(active_size, G, mask, WSS_LOW|WSS_YPOS, WSS_LOW,
+						 Gmaxn, QD[in], QD, get_Q_view(in), -2.0, Gmaxn2, obj_diffn_min);
 		else
-		{
-			if (!is_upper_bound(j))
-			{
-				double grad_diff=Gmaxn-G[j];
-				if (-G[j] >= Gmaxn2)
-					Gmaxn2 = -G[j];
-				if (grad_diff > 0)
-				{
-					double obj_diff; 
-					double quad_coef = QD[in]+QD[j]-2*Q_in[j];
-					if (quad_coef > 0)
-						obj_diff = -(grad_diff*grad_diff)/quad_coef;
-					else
-						obj_diff = -(grad_diff*grad_diff)/TAU;
-
-					if (obj_diff <= obj_diff_min)
-					{
-						Gmin_idx=j;
-						obj_diff_min = obj_diff;
-					}
-				}
-			}
-		}
+			Gminn_idx = wss_scan_low(active_size, G, mask, WSS_LOW|WSS_YPOS, WSS_LOW,
+						 Gmaxn, QD[in], QD, Q->get_Q(in,active_size), -2.0, Gmaxn2, obj_diffn_min);
 	}
 
 	if(max(Gmaxp+Gmaxp2,Gmaxn+Gmaxn2) < eps)
 		return 1;
 
+	// the later index wins a tie, as in a single sweep over both classes
+	int Gmin_idx;
+	if(Gminn_idx == -1 || (Gminp_idx != -1 &&
+	   (obj_diffp_min < obj_diffn_min ||
+	    (obj_diffp_min == obj_diffn_min && Gminp_idx > Gminn_idx))))
+		Gmin_idx = Gminp_idx;
+	else
+		Gmin_idx = Gminn_idx;
+
 	if (y[Gmin_idx] == +1)
-		out_i = Gmaxp_idx;
+		out_i = ip;
 	else
-		out_i = Gmaxn_idx;
+		out_i = in;
 	out_j = Gmin_idx;
 
 	return 0;
@@ -1348,13 +2107,15 @@ double Solver_NU::calculate_rho()
 
 class Solver_SPOC {
 public:
-	Solver_SPOC() {};
+	Solver_SPOC(Budget *budget_ = NULL) { budget = budget_; };
 	~Solver_SPOC() {};
-	void Solve(int l, const Kernel& Q, double *alpha_, short *y_,
-	double *C_, double eps, int shrinking, int nr_class);
+	// returns the objective value
+	double Solve(int l, const Kernel& Q, double *alpha_, short *y_,
+	double *C_, double eps, int shrinking, int nr_class, int qpsize);
 private:
+	Budget *budget;
 	int active_size;
-	double *G;	// gradient of objective function
+	double *G;	// gradient of objective function, G[i*nr_class+m]
 	short *y;
 	bool *alpha_status;	// free:true, bound:false
 	double *alpha;
@@ -1365,6 +2126,11 @@ private:
 	int *active_set;
 	int l, nr_class;
 	bool unshrinked;
+
+	int qpsize;		// columns fetched at once
+	int *batch;
+	const Qfloat **batch_Q;
+	double *D;		// nr_class+1 doubles for solve_sub_problem
 	
 	double get_C(int i, int m)
 	{
@@ -1381,6 +2147,7 @@ private:
 	void swap_index(int i, int j);
 	double select_working_set(int &q);
 	void solve_sub_problem(double A, double *B, double C, double *nu);
+	void add_gradient(int n, int start);
 	void reconstruct_gradient();
 	void do_shrinking();
 };
@@ -1399,40 +2166,79 @@ void Solver_SPOC::swap_index(int i, int j)
 	}
 }
 
+// add the terms of the first n samples to G[j*nr_class+m], j >= start:
+// each column with a nonzero alpha is fetched once, qpsize at a time,
+// and then updates all classes of every sample
+void Solver_SPOC::add_gradient(int n, int start)
+{
+	int i = 0;
+	while (i < n)
+	{
+		int nb = 0;
+		for (;i<n && nb<qpsize;i++)
+		{
+			const double *alpha_i = &alpha[i*nr_class];
+			for (int m=0;m<nr_class;m++)
+				if (alpha_i[m] != 0)
+				{
+					batch[nb++] = i;
+					break;
+				}
+		}
+		if (nb == 0)
+			break;
+		Q->get_Q_batch(batch, nb, l, batch_Q);
+
+		const Qfloat **Qs = batch_Q;
+		const int *b = batch;
+		const double *a = alpha;
+		double *g = G;
+		int nc = nr_class;
+#pragma omp parallel for schedule(static)
+		for (int j=start;j<l;j++)
+		{
+			double *G_j = &g[j*nc];
+			for (int k=0;k<nb;k++)
+			{
+				const double *alpha_i = &a[b[k]*nc];
+				double Q_ij = Qs[k][j];
+				for (int m=0;m<nc;m++)
+					G_j[m] += alpha_i[m]*Q_ij;
+			}
+		}
+	}
+}
+
 void Solver_SPOC::reconstruct_gradient()
 {
 	if (active_size == l) return;
-	int i, m;
+	TM_COUNT(TM_UNSHRINK, 1);
+	int i;
 
 	for (i=active_size*nr_class;i<l*nr_class;i++)
 		G[i] = 1;
 	for (i=active_size;i<l;i++)
 		G[i*nr_class+y[i]] = 0;
-		
-	for (i=0;i<active_size;i++)
-		for (m=0;m<nr_class;m++)
-			if (fabs(alpha[i*nr_class+m]) != 0)
-			{
-				Qfloat *Q_i = Q->get_Q(i,l);
-				double alpha_i_m = alpha[i*nr_class+m];
-				for (int j=active_size;j<l;j++)
-					G[j*nr_class+m] += alpha_i_m*Q_i[j];
-			}
+	add_gradient(active_size, active_size);
 }
 
-void Solver_SPOC::Solve(int l, const Kernel&Q, double *alpha_, short *y_,
-	double *C_, double eps, int shrinking, int nr_class)
+double Solver_SPOC::Solve(int l, const Kernel&Q, double *alpha_, short *y_,
+	double *C_, double eps, int shrinking, int nr_class, int qpsize)
 {
 	this->l = l;
 	this->nr_class = nr_class;
 	this->Q = &Q;
+	this->qpsize = max(qpsize, 1);
+	batch = new int[this->qpsize];
+	batch_Q = new const Qfloat *[this->qpsize];
+	D = new double[nr_class+1];
 	clone(y,y_,l);
 	clone(alpha,alpha_,l*nr_class);
 	C = C_;
 	this->eps = eps;
 	unshrinked = false;
 
-	int i, m, q, old_q = -1;
+	int i, m, q = -1, old_q = -1;
 	// initialize alpha_status
 	{
 		alpha_status = new bool[l*nr_class];
@@ -1457,25 +2263,20 @@ void Solver_SPOC::Solve(int l, const Kernel&Q, double *alpha_, short *y_,
 			G[i] = 1;
 		for (i=0;i<l;i++)
 			G[i*nr_class+y[i]] = 0;
-		
-		for (i=0;i<l;i++)
-			for (m=0;m<nr_class;m++)
-				if (fabs(alpha[i*nr_class+m]) != 0)
-				{
-					Qfloat *Q_i = Q.get_Q(i,l);
-					double alpha_i_m = alpha[i*nr_class+m];
-					for (int j=0;j<l;j++)
-						G[j*nr_class+m] += alpha_i_m*Q_i[j];
-				}
+		add_gradient(l, 0);
 	}
 	
 	// optimization step
 
 	int iter = 0, counter = min(l*2, 2000) + 1;
+	int max_iter = budget ? budget->iter_left() : INT_MAX;
+	int status = SOLVE_CONVERGED;
 	double *B = new double[nr_class];
 	double *nu = new double[nr_class];
+	double *d = new double[nr_class];
+	TM_COUNT(TM_RUN, 1);
 	
-	while (1)
+	while (iter < max_iter)
 	{
 
 		// show progress and do shrinking
@@ -1483,11 +2284,15 @@ void Solver_SPOC::Solve(int l, const Kernel&Q, double *alpha_, short *y_,
 		if (--counter == 0)
 		{
 			if (shrinking) 
-				do_shrinking();
+				TM_SHRINKING(active_size, do_shrinking());
 			//	info(".");
 			counter = min(l*2, 2000);
+			TM_TRACE(iter, active_size);
+			if (budget && (status = budget->poll()) != SOLVE_CONVERGED)
+				break;
 		}
 	
+		TM_START(t_select);
 		if (select_working_set(q) < eps)
 		{
 			// reconstruct the whole gradient
@@ -1505,10 +2310,14 @@ void Solver_SPOC::Solve(int l, const Kernel&Q, double *alpha_, short *y_,
 		    break;
 
 		old_q = q;
+		TM_STOP(TM_SELECT, t_select);
 
 		++iter;
 		
+		TM_START(t_fetch);
 		const Qfloat *Q_q = Q.get_Q(q, active_size);
+		TM_STOP(TM_FETCH, t_fetch);
+		TM_START(t_alpha);
 		double A = Q_q[q];
 		for (m=0;m<nr_class;m++)
 			B[m] = G[q*nr_class+m] - A*alpha[q*nr_class+m];
@@ -1525,25 +2334,46 @@ void Solver_SPOC::Solve(int l, const Kernel&Q, double *alpha_, short *y_,
 			nu[i] = -C[y[q]];
 		}
 		nu[y[q]] += C[y[q]];
+		TM_STOP(TM_ALPHA, t_alpha);
 
+		TM_START(t_gradient);
 		for (m=0;m<nr_class;m++)
 		{
-			double d = nu[m] - alpha[q*nr_class+m];
-#if 0 
-			if (fabs(d) > 1e-12)
-#endif			
-			  {
-				alpha[q*nr_class+m] = nu[m];
-				update_alpha_status(q, m);
-				for (i=0;i<active_size;i++)
-					G[i*nr_class+m] += d*Q_q[i];
-			  }
+			d[m] = nu[m] - alpha[q*nr_class+m];
+			alpha[q*nr_class+m] = nu[m];
+			update_alpha_status(q, m);
+		}
+		{
+			const double *dd = d;
+			double *g = G;
+			int nc = nr_class;
+#pragma omp parallel for schedule(static)
+			for (int t=0;t<active_size;t++)
+			{
+				double *G_t = &g[t*nc];
+				double Q_tq = Q_q[t];
+				for (int mm=0;mm<nc;mm++)
+					G_t[mm] += dd[mm]*Q_tq;
+			}
 		}
+		TM_STOP(TM_GRADIENT, t_gradient);
 
 	}
+	TM_COUNT(TM_ITER, iter);
 	
 	delete[] B;
 	delete[] nu;
+	delete[] d;
+
+	if (iter >= max_iter)
+		status = SOLVE_MAX_ITER;
+	if (status != SOLVE_CONVERGED)
+	{
+		reconstruct_gradient();
+		active_size = l;
+	}
+	if (budget)
+		budget->spend(iter, status);
 	
 	// calculate objective value
 	double obj = 0;
@@ -1580,29 +2410,50 @@ void Solver_SPOC::Solve(int l, const Kernel&Q, double *alpha_, short *y_,
 	delete[] G;
 	delete[] y;
 	delete[] alpha;
-
+	delete[] batch;
+	delete[] batch_Q;
+	delete[] D;
+	return obj;
 }
 
 double Solver_SPOC::select_working_set(int &q)
 {
 	double vio_q = -INF;
-	
-	int j = 0;
-	for (int i=0;i<active_size;i++)
+	int q_ = -1;
+
+	// each thread finds the first most violating sample of its block,
+	// the lowest of those wins as in a sequential scan
+#pragma omp parallel
 	{
-		double lb = -INF, ub = INF;
-		for (int m=0;m<nr_class;m++,j++)
+		double vio = -INF;
+		int q_t = -1;
+#pragma omp for schedule(static) nowait
+		for (int i=0;i<active_size;i++)
 		{
-			lb = max(G[j], lb);
-			if (alpha_status[j])
-				ub = min(G[j], ub);
+			const double *G_i = &G[i*nr_class];
+			const bool *alpha_status_i = &alpha_status[i*nr_class];
+			double lb = -INF, ub = INF;
+			for (int m=0;m<nr_class;m++)
+			{
+				lb = max(G_i[m], lb);
+				if (alpha_status_i[m])
+					ub = min(G_i[m], ub);
+			}
+			if (lb - ub > vio)
+			{
+				q_t = i;
+				vio = lb - ub;
+			}
 		}
-		if (lb - ub > vio_q)
+#pragma omp critical(spoc_select)
+		if (q_t >= 0 && (vio > vio_q || (vio == vio_q && q_t < q_)))
 		{
-			q = i;
-			vio_q = lb - ub;
+			q_ = q_t;
+			vio_q = vio;
 		}
 	}
+	if (q_ >= 0)
+		q = q_;
 	
 	return vio_q;
 }
@@ -1672,16 +2523,14 @@ int compar(const void *a, const void *b)
 void Solver_SPOC::solve_sub_problem(double A, double *B, double C, double *nu)
 {
 	int r;
-	double *D;
 	
-	clone(D, B, nr_class+1);
+	memcpy(D, B, sizeof(double)*nr_class);
 	qsort(D, nr_class, sizeof(double), compar);
 	D[nr_class] = -INF;
 	
 	double phi = D[0] - A*C;
 	for (r=0;phi<(r+1)*D[r+1];r++)
 		phi += D[r+1];
-	delete[] D;
 		
 	phi /= (r+1);
 	for (r=0;r<nr_class;r++)
@@ -1692,34 +2541,191 @@ void Solver_SPOC::solve_sub_problem(double A, double *B, double C, double *nu)
 extern "C" {
 #endif
 void solvebqp(struct BQP*);
+void dtron(struct tron_ctx *, int, double *, double *, double *, double, double, double, double, int, double, double *, int *);
 #ifdef __cplusplus
 }
 #endif
 
-class Solver_B {
-public:
-	Solver_B() {};
-	virtual ~Solver_B() {};
+// Working-set subproblems are tiny (qpsize is 10 in ksvm), so they are
+// first handed to a primal active-set method that keeps everything in
+// fixed-size arrays on the stack: Newton steps on the free variables,
+// a ratio test against the box, and one bound released per face.
+// TRON stays as the fallback when the method does not settle.
+#define SMALL_BQP_MAX 16
 
-	struct SolutionInfo {
-		double obj;
-		double *upper_bound;
-	};
+template<int N> static bool small_chol(int nf, const int *F, const double *Q, int n, double lambda, double *L)
+{
+	for (int a=0;a<nf;a++)
+		for (int b=0;b<=a;b++)
+		{
+			double s = Q[F[a]*n+F[b]];
+			if (a == b)
+				s += lambda;
+			for (int k=0;k<b;k++)
+				s -= L[a*N+k]*L[b*N+k];
+			if (a == b)
+			{
+				if (s <= 0)
+					return false;
+				L[a*N+a] = sqrt(s);
+			}
+			else
+				L[a*N+b] = s/L[b*N+b];
+		}
+	return true;
+}
 
-	virtual void Solve(int l, const Kernel& Q, double *b_, schar *y_,
-	double *alpha_, double Cp, double Cn, double eps, SolutionInfo* si, 
-	int shrinking, int qpsize);
-  
-protected:
-	int active_size;
-	double *G;		// gradient of objective function
-	enum { LOWER_BOUND, UPPER_BOUND, FREE };
-	char *alpha_status;	// LOWER_BOUND, UPPER_BOUND, FREE
-	double *alpha;
-	const Kernel *Q;
-	double eps;
+template<int N> static bool solve_small_bqp(BQP *qp)
+{
+	const int n = qp->n;
+	const double *Q = qp->Q, *p = qp->p, *C = qp->C;
+	double *x = qp->x;
+	double g[N], d[N], L[N*N];
+	int F[N];
+	bool fr[N];
+	int i, j, k;
+
+	double gnorm0 = 0;
+	for (i=0;i<n;i++)
+	{
+		x[i] = max(0.0, min(x[i], C[i]));
+		fr[i] = x[i] > 0 && x[i] < C[i];
+	}
+	for (i=0;i<n;i++)
+	{
+		g[i] = p[i];
+		for (j=0;j<n;j++)
+			g[i] += Q[i*n+j]*x[j];
+		gnorm0 += g[i]*g[i];
+	}
+	const double tol = qp->eps*sqrt(gnorm0);
 
-	int *active_set;
+	for (int it=0;it<10*N;it++)
+	{
+		int nf = 0;
+		double gmax = 0;
+		for (i=0;i<n;i++)
+			if (fr[i])
+			{
+				F[nf++] = i;
+				gmax = max(gmax, fabs(g[i]));
+			}
+
+		if (gmax <= tol)
+		{
+			// minimal on this face: free the bound with the largest
+			// inward gradient, or stop if the KKT conditions hold
+			int r = -1;
+			double vr = tol;
+			for (i=0;i<n;i++)
+				if (!fr[i] && C[i] > 0)
+				{
+					double v = x[i] <= 0 ? -g[i] : g[i];
+					if (v > vr)
+					{
+						vr = v;
+						r = i;
+					}
+				}
+			if (r < 0)
+				return true;
+			fr[r] = true;
+			continue;
+		}
+
+		// Newton step on the free variables, shifted like dprecond
+		// when the face is only semidefinite
+		if (!small_chol<N>(nf, F, Q, n, 0, L) &&
+		    !small_chol<N>(nf, F, Q, n, 1e-3/512/512, L))
+			return false;
+		for (k=0;k<nf;k++)
+		{
+			double s = -g[F[k]];
+			for (j=0;j<k;j++)
+				s -= L[k*N+j]*d[j];
+			d[k] = s/L[k*N+k];
+		}
+		for (k=nf-1;k>=0;k--)
+		{
+			double s = d[k];
+			for (j=k+1;j<nf;j++)
+				s -= L[j*N+k]*d[j];
+			d[k] = s/L[k*N+k];
+		}
+
+		// longest feasible fraction of the step
+		double step = 1;
+		int blk = -1;
+		for (k=0;k<nf;k++)
+		{
+			i = F[k];
+			if (d[k] < 0 && x[i] + step*d[k] < 0)
+			{
+				step = -x[i]/d[k];
+				blk = k;
+			}
+			else if (d[k] > 0 && x[i] + step*d[k] > C[i])
+			{
+				step = (C[i] - x[i])/d[k];
+				blk = k;
+			}
+		}
+		for (k=0;k<nf;k++)
+			x[F[k]] = max(0.0, min(x[F[k]] + step*d[k], C[F[k]]));
+		if (blk >= 0)
+		{
+			i = F[blk];
+			x[i] = d[blk] < 0 ? 0 : C[i];
+			fr[i] = false;
+		}
+
+		for (i=0;i<n;i++)
+		{
+			g[i] = p[i];
+			for (j=0;j<n;j++)
+				g[i] += Q[i*n+j]*x[j];
+		}
+	}
+	return false;
+}
+
+// a failed attempt leaves a feasible x with a lower objective, which
+// TRON takes as its starting point
+static void solve_bqp(BQP *qp)
+{
+	bool done = false;
+	if (qp->n <= 8)
+		done = solve_small_bqp<8>(qp);
+	else if (qp->n <= SMALL_BQP_MAX)
+		done = solve_small_bqp<SMALL_BQP_MAX>(qp);
+	if (!done)
+		solvebqp(qp);
+}
+
+class Solver_B {
+public:
+	Solver_B(Budget *budget_ = NULL) { budget = budget_; };
+	virtual ~Solver_B() {};
+
+	struct SolutionInfo {
+		double obj;
+		double *upper_bound;
+	};
+
+	virtual void Solve(int l, const Kernel& Q, double *b_, schar *y_,
+	double *alpha_, double Cp, double Cn, double eps, SolutionInfo* si, 
+	int shrinking, int qpsize);
+  
+protected:
+	int active_size;
+	double *G;		// gradient of objective function
+	enum { LOWER_BOUND, UPPER_BOUND, FREE };
+	char *alpha_status;	// LOWER_BOUND, UPPER_BOUND, FREE
+	double *alpha;
+	const Kernel *Q;
+	double eps;
+
+	int *active_set;
 	double *G_bar;		// gradient, if we treat free variables as 0
 	int l;
 	bool unshrinked;	// XXX
@@ -1727,6 +2733,34 @@ protected:
 	int qpsize;
 	int *working_set;
   	int *old_working_set;
+	Budget *budget;
+
+	// Subproblem of the previous iteration.  Entries between variables
+	// that stay in the working set are copied from last_Q instead of
+	// being recomputed; last_q is reset whenever indices are permuted.
+	int *last_set;
+	int last_q;
+	double *last_Q;
+	int *last_pos;		// position of working_set[i] in last_set, or -1
+	Qfloat **QB;		// working set columns, fetched on demand
+	double *positive_max;	// select_working_set scratch
+	int *positive_set;
+
+	void new_subproblem(BQP &qp);
+	void delete_subproblem(BQP &qp);
+	void reuse_subproblem(BQP &qp, int q);
+	void keep_subproblem(int q)
+	{
+		memcpy(last_set, working_set, sizeof(int)*q);
+		last_q = q;
+	}
+	bool kept(int i, int j, double &Q_ij) const
+	{
+		if (last_pos[i] < 0 || last_pos[j] < 0)
+			return false;
+		Q_ij = last_Q[last_pos[i]*last_q+last_pos[j]];
+		return true;
+	}
 
 	virtual double get_C(int i)
 	{
@@ -1755,8 +2789,63 @@ private:
 	schar *y;
 };
 
+void Solver_B::new_subproblem(BQP &qp)
+{
+	working_set = new int[qpsize];
+	old_working_set = new int[qpsize];
+	qp.C = new double[qpsize];
+	qp.x = new double[qpsize];
+	qp.p = new double[qpsize];
+	qp.Q = new double[qpsize*qpsize];
+	qp.work = new double[BQP_WORKSIZE(qpsize)];
+	qp.iwork = new int[qpsize];
+	last_set = new int[qpsize];
+	last_q = 0;
+	last_Q = new double[qpsize*qpsize];
+	last_pos = new int[qpsize];
+	QB = new Qfloat *[qpsize];
+	positive_max = new double[qpsize];
+	positive_set = new int[qpsize];
+}
+
+void Solver_B::delete_subproblem(BQP &qp)
+{
+	delete[] working_set;
+	delete[] old_working_set;
+	delete[] qp.p;
+	delete[] qp.C;
+	delete[] qp.x;
+	delete[] qp.Q;
+	delete[] qp.work;
+	delete[] qp.iwork;
+	delete[] last_set;
+	delete[] last_Q;
+	delete[] last_pos;
+	delete[] QB;
+	delete[] positive_max;
+	delete[] positive_set;
+}
+
+// Hand the previous Hessian to last_Q and locate each member of the
+// new working set in the previous one.
+void Solver_B::reuse_subproblem(BQP &qp, int q)
+{
+	swap(qp.Q, last_Q);
+	for (int i=0;i<q;i++)
+	{
+		last_pos[i] = -1;
+		for (int k=0;k<last_q;k++)
+			if (last_set[k] == working_set[i])
+			{
+				last_pos[i] = k;
+				break;
+			}
+	}
+}
+
 void Solver_B::swap_index(int i, int j)
 {
+	last_q = 0;
 	Q->swap_index(i,j);
 	swap(y[i],y[j]);
 	swap(G[i],G[j]);
@@ -1772,6 +2861,7 @@ void Solver_B::reconstruct_gradient()
 	// reconstruct inactive elements of G from G_bar and free variables
 
 	if(active_size == l) return;
+	TM_COUNT(TM_UNSHRINK, 1);
 
 	int i;
 	for(i=active_size;i<l;i++)
@@ -1818,17 +2908,12 @@ void Solver_B::Solve(int l, const Kernel& Q, double *b_, schar *y_,
 	}
 
 	BQP qp;
-	working_set = new int[qpsize];
-	old_working_set = new int[qpsize];
+	new_subproblem(qp);
 	qp.eps = eps/10;
-	qp.C = new double[qpsize];
-	qp.x = new double[qpsize];
-	qp.p = new double[qpsize];
-	qp.Q = new double[qpsize*qpsize];
 
 	// initialize gradient
 	{
-		G = new double[l];
+		G = aligned_new<double>(l);
 		G_bar = new double[l];
 		int i;
 		for(i=0;i<l;i++)
@@ -1856,22 +2941,29 @@ void Solver_B::Solve(int l, const Kernel& Q, double *b_, schar *y_,
 
 	int iter = 0;
 	int counter = min(l*2/qpsize,2000/qpsize)+1;
+	int max_iter = budget ? budget->iter_left() : INT_MAX;
+	int status = SOLVE_CONVERGED;
+	TM_COUNT(TM_RUN, 1);
 
 	for (int i=0;i<qpsize;i++)
 	  old_working_set[i] = -1;
 
-	while(1)
+	while(iter < max_iter)
 	{
 		// show progress and do shrinking
 
 		if(--counter == 0)
 		{
 			counter = min(l*2/qpsize, 2000/qpsize);
-			if(shrinking) do_shrinking();
+			if(shrinking) TM_SHRINKING(active_size, do_shrinking());
 			//info(".");
+			TM_TRACE(iter, active_size);
+			if(budget && (status = budget->poll()) != SOLVE_CONVERGED)
+				break;
 		}
 
 		int i,j,q;
+		TM_START(t_select);
 		if (select_working_set(q) < eps)
 		{
 			// reconstruct the whole gradient
@@ -1885,13 +2977,17 @@ void Solver_B::Solve(int l, const Kernel& Q, double *b_, schar *y_,
 				counter = 1;	// do shrinking next iteration
 		}
 		
+		TM_STOP(TM_SELECT, t_select);
 		++iter;
 
-		// construct subproblem
-		Qfloat **QB;
-		QB = new Qfloat *[q];
+		// construct subproblem, fetching only the columns of
+		// variables that are new to the working set
+		reuse_subproblem(qp, q);
+		TM_START(t_fetch);
 		for (i=0;i<q;i++)
-			QB[i] = Q.get_Q(working_set[i], active_size);
+			QB[i] = last_pos[i] < 0 ? Q.get_Q(working_set[i], active_size) : NULL;
+		TM_STOP(TM_FETCH, t_fetch);
+		TM_START(t_alpha);
 		qp.n = q;
 		for (i=0;i<qp.n;i++)
 			qp.p[i] = G[working_set[i]];
@@ -1900,18 +2996,25 @@ void Solver_B::Solve(int l, const Kernel& Q, double *b_, schar *y_,
 			int Bi = working_set[i];
 			qp.x[i] = alpha[Bi];
 			qp.C[i] = get_C(Bi);
-			qp.Q[i*qp.n+i] = QB[i][Bi];
+			if (!kept(i, i, qp.Q[i*qp.n+i]))
+				qp.Q[i*qp.n+i] = QB[i][Bi];
 			qp.p[i] -= qp.Q[i*qp.n+i]*alpha[Bi];
 			for (j=i+1;j<qp.n;j++)
 			{			
 				int Bj = working_set[j];
-				qp.Q[i*qp.n+j] = qp.Q[j*qp.n+i] = QB[i][Bj];
+				double Q_ij;
+				if (!kept(i, j, Q_ij))
+					Q_ij = QB[i] ? QB[i][Bj] : QB[j][Bi];
+				qp.Q[i*qp.n+j] = qp.Q[j*qp.n+i] = Q_ij;
 				qp.p[i] -= qp.Q[i*qp.n+j]*alpha[Bj];
 				qp.p[j] -= qp.Q[j*qp.n+i]*alpha[Bi];
 			}
 		}
+		keep_subproblem(q);
 	
-		solvebqp(&qp);
+		solve_bqp(&qp);
+		TM_STOP(TM_ALPHA, t_alpha);
+		TM_START(t_gradient);
 		
 		// update G
 
@@ -1921,6 +3024,8 @@ void Solver_B::Solve(int l, const Kernel& Q, double *b_, schar *y_,
 			if(fabs(d)>1e-12)
 			{
 				alpha[working_set[i]] = qp.x[i];
+				if (!QB[i])
+					QB[i] = Q.get_Q(working_set[i], active_size);
 				Qfloat *QB_i = QB[i];
 				for(j=0;j<active_size;j++)
 					G[j] += d*QB_i[j];
@@ -1949,8 +3054,19 @@ void Solver_B::Solve(int l, const Kernel& Q, double *b_, schar *y_,
 			}
 		}
 
-		delete[] QB;
+		TM_STOP(TM_GRADIENT, t_gradient);
+	}
+	TM_COUNT(TM_ITER, iter);
+
+	if(iter >= max_iter)
+		status = SOLVE_MAX_ITER;
+	if(status != SOLVE_CONVERGED)
+	{
+		reconstruct_gradient();
+		active_size = l;
 	}
+	if(budget)
+		budget->spend(iter, status);
 
 	// calculate objective value
 	{
@@ -1985,49 +3101,25 @@ void Solver_B::Solve(int l, const Kernel& Q, double *b_, schar *y_,
 	delete[] active_set;
 	delete[] alpha;
 	delete[] alpha_status;
-	delete[] G;
+	aligned_delete(G);
 	delete[] G_bar;
 	delete[] y;
 
-	delete[] working_set;
-	delete[] old_working_set;
-	delete[] qp.p;
-	delete[] qp.C;
-	delete[] qp.x;
-	delete[] qp.Q;
+	delete_subproblem(qp);
 }
 
 // return maximal violation
 double Solver_B::select_working_set(int &q)
 {
-	int i, j, q_2 = qpsize/2;
+	int i, q_2 = qpsize/2;
 	double maxvio = 0, max0;
-	double *positive_max;
-	int *positive_set;
 
-	positive_max = new double[qpsize];
-	positive_set = new int[qpsize];
 	q = 0;
 
 	for (i=0;i<q_2;i++)
 		positive_max[i] = INF/2;
-	for (i=0;i<active_size;i++)
-	{	
-		if(!is_free(i)) continue;
-		double v = fabs(G[i]);
-		if(v < positive_max[0])
-		{
-			for (j=1;j<q_2;j++)
-			{
-				if (v >= positive_max[j])
-					break;
-				positive_max[j-1] = positive_max[j];
-				positive_set[j-1] = positive_set[j];
-			}
-			positive_max[j-1] = v;
-			positive_set[j-1] = i;
-		}
-	} 
+	bwss_scan_free(active_size, G, alpha_status, FREE,
+		       positive_max, positive_set, q_2);
 	for (i=0;i<q_2;i++)
 		if (positive_max[i] != INF/2)
 			working_set[q++] = positive_set[i];
@@ -2036,31 +3128,8 @@ double Solver_B::select_working_set(int &q)
 				
 	for (i=0;i<q_2;i++)
 		positive_max[i] = -INF;
-	for (i=0;i<active_size;i++)
-	{
-		double v = fabs(G[i]);
-		if (is_free(i) && v <= max0) continue;
-		if(is_upper_bound(i))
-		{
-			if(G[i]<0) continue;
-		}
-		else if(is_lower_bound(i))
-		{
-			if(G[i]>0) continue;
-		}
-		if (v > positive_max[0])
-		{
-			for (j=1;j<q_2;j++)
-			{
-				if (v <= positive_max[j])
-					break;
-				positive_max[j-1] = positive_max[j];
-				positive_set[j-1] = positive_set[j];
-			}
-			positive_max[j-1] = v;
-			positive_set[j-1] = i;
-		}
-	}
+	bwss_scan_vio(active_size, G, alpha_status, FREE, UPPER_BOUND, LOWER_BOUND,
+		      max0, positive_max, positive_set, q_2);
 	for (i=0;i<q_2;i++)
 		if (positive_max[i] != -INF)
 		{
@@ -2068,8 +3137,6 @@ double Solver_B::select_working_set(int &q)
 			maxvio = max(maxvio,positive_max[i]);
 		}
 
-	delete[] positive_set;
-	delete[] positive_max;
 	return maxvio;
 }
 
@@ -2147,7 +3214,7 @@ void Solver_B::do_shrinking()
 class Solver_B_linear : public Solver_B
 {
 public:
-	Solver_B_linear() {};
+	Solver_B_linear(Budget *budget_ = NULL): Solver_B(budget_) {};
 	~Solver_B_linear() {};
 	int Solve(int l, svm_node * const * x_, double *b_, schar *y_,
 	double *alpha_, double *w, double Cp, double Cn, double eps, SolutionInfo* si, 
@@ -2159,39 +3226,64 @@ private:
 	}
 	void swap_index(int i, int j);
 	void reconstruct_gradient();
-	double dot(int i, int j);
+	void scatter(int i, double *v);
+	void gather(int i, double *v);
+	double dot(int i, const double *v);
+	void compute_gradient(int from, int to);
 	double Cp, Cn;
 	double *b;
 	schar *y;
 	double *w;
 	const svm_node **x;
+	double *x_square;	// x_i^T x_i
+	double *dense;		// one row of x scattered, zero outside scatter/gather
 };
 
-double Solver_B_linear::dot(int i, int j)
+// v[k] = x_ik
+void Solver_B_linear::scatter(int i, double *v)
+{
+	for (const svm_node *px = x[i];px->index != -1;px++)
+		v[px->index] = px->value;
+}
+
+// v[k] = 0 where x_ik is stored
+void Solver_B_linear::gather(int i, double *v)
+{
+	for (const svm_node *px = x[i];px->index != -1;px++)
+		v[px->index] = 0;
+}
+
+// x_i^T v without the bias v[0]
+double Solver_B_linear::dot(int i, const double *v)
 {
-	const svm_node *px = x[i], *py = x[j];	
 	double sum = 0;
-	while(px->index != -1 && py->index != -1)
+	for (const svm_node *px = x[i];px->index != -1;px++)
+		sum += v[px->index]*px->value;
+	return sum;
+}
+
+// G_j = y_j (w^T x_j + w_0) + b_j for j in [from, to), rows are
+// independent given w
+void Solver_B_linear::compute_gradient(int from, int to)
+{
+	const svm_node * const *x = this->x;
+	const double *w = this->w, *b = this->b;
+	const schar *y = this->y;
+	double *G = this->G;
+#pragma omp parallel for schedule(static)
+	for(int j=from;j<to;j++)
 	{
-		if(px->index == py->index)
-		{
-			sum += px->value * py->value;
-			++px;
-			++py;
-		}
-		else
-		{
-			if(px->index > py->index)
-				++py;
-			else
-				++px;
-		}			
+		double sum = 0;
+		for (const svm_node *px = x[j];px->index != -1;px++)
+			sum += w[px->index]*px->value;
+		sum += w[0];
+		G[j] = y[j]*sum + b[j];
 	}
-	return sum;
 }
 
 void Solver_B_linear::swap_index(int i, int j)
 {
+	last_q = 0;
 	swap(y[i],y[j]);
 	swap(G[i],G[j]);
 	swap(alpha_status[i],alpha_status[j]);
@@ -2199,19 +3291,14 @@ void Solver_B_linear::swap_index(int i, int j)
 	swap(b[i],b[j]);
 	swap(active_set[i],active_set[j]);
 	swap(x[i], x[j]);
+	swap(x_square[i], x_square[j]);
 }
 
 void Solver_B_linear::reconstruct_gradient()
 {
-	int i;
-	for(i=active_size;i<l;i++)
-	{
-		double sum = 0;
-		for (const svm_node *px = x[i];px->index != -1;px++)
-			sum += w[px->index]*px->value;
-		sum += w[0];
-		G[i] = y[i]*sum + b[i];
-	}
+	if(active_size == l) return;
+	TM_COUNT(TM_UNSHRINK, 1);
+	compute_gradient(active_size, l);
 }
 
 int Solver_B_linear::Solve(int l, svm_node * const * x_, double *b_, schar *y_,
@@ -2230,6 +3317,25 @@ int Solver_B_linear::Solve(int l, svm_node * const * x_, double *b_, schar *y_,
 	this->w = w;
 	unshrinked = false;
 
+	// row norms and a dense row for the subproblems
+	{
+		int n = 0;
+		x_square = new double[l];
+		for(int i=0;i<l;i++)
+		{
+			double sum = 0;
+			for (const svm_node *px = x[i];px->index != -1;px++)
+			{
+				sum += px->value * px->value;
+				n = max(n, px->index);
+			}
+			x_square[i] = sum;
+		}
+		dense = new double[n+1];
+		for(int k=0;k<=n;k++)
+			dense[k] = 0;
+	}
+
 	// initialize alpha_status
 	{
 		alpha_status = new char[l];
@@ -2246,13 +3352,8 @@ int Solver_B_linear::Solve(int l, svm_node * const * x_, double *b_, schar *y_,
 	}
 
 	BQP qp;
-	working_set = new int[qpsize];
-	old_working_set = new int[qpsize];
+	new_subproblem(qp);
 	qp.eps = eps/100;
-	qp.C = new double[qpsize];
-	qp.x = new double[qpsize];
-	qp.p = new double[qpsize];
-	qp.Q = new double[qpsize*qpsize];
 
 	// initialize gradient
 	{
@@ -2266,33 +3367,33 @@ int Solver_B_linear::Solve(int l, svm_node * const * x_, double *b_, schar *y_,
 				allzero = false;
 		}
 		if (!allzero)
-			for(i=0;i<l;i++)
-			{
-				double sum = 0;
-				for (const svm_node *px = x[i];px->index != -1;px++)
-					sum += w[px->index]*px->value;
-				sum += w[0];
-				G[i] += y[i]*sum;
-			}			
+			compute_gradient(0, l);
 	}
 
 	// optimization step
 
 	int iter = 0;
 	int counter = min(l*2/qpsize,2000/qpsize)+1;
+	int max_iter = budget ? budget->iter_left() : INT_MAX;
+	int status = SOLVE_CONVERGED;
+	TM_COUNT(TM_RUN, 1);
 
-	while(1)
+	while(iter < max_iter)
 	{
 		// show progress and do shrinking
 
 		if(--counter == 0)
 		{
 			counter = min(l*2/qpsize, 2000/qpsize);
-			if(shrinking) do_shrinking();
+			if(shrinking) TM_SHRINKING(active_size, do_shrinking());
 			//	info(".");
+			TM_TRACE(iter, active_size);
+			if(budget && (status = budget->poll()) != SOLVE_CONVERGED)
+				break;
 		}
 
 		int i,j,q;
+		TM_START(t_select);
 		if (select_working_set(q) < eps)
 		{
 			// reconstruct the whole gradient
@@ -2323,29 +3424,51 @@ int Solver_B_linear::Solve(int l, svm_node * const * x_, double *b_, schar *y_,
 		for (i=0;i<qpsize;i++)
 			old_working_set[i] = working_set[i];
 		
+		TM_STOP(TM_SELECT, t_select);
 		++iter;
 
-		// construct subproblem
+		// construct subproblem, with x_Bi scattered into dense while
+		// its new entries of row i are computed
+		TM_START(t_alpha);
+		reuse_subproblem(qp, q);
 		qp.n = q;
 		for (i=0;i<qp.n;i++)
 			qp.p[i] = G[working_set[i]];
 		for (i=0;i<qp.n;i++)
 		{
 			int Bi = working_set[i];
+			bool scattered = false;
 			qp.x[i] = alpha[Bi];
 			qp.C[i] = get_C(Bi);
-			qp.Q[i*qp.n+i] = dot(Bi, Bi) + 1;
+			if (!kept(i, i, qp.Q[i*qp.n+i]))
+				qp.Q[i*qp.n+i] = x_square[Bi] + 1;
 			qp.p[i] -= qp.Q[i*qp.n+i]*alpha[Bi];
 			for (j=i+1;j<qp.n;j++)
 			{			
 				int Bj = working_set[j];
-				qp.Q[i*qp.n+j] = qp.Q[j*qp.n+i] = y[Bi]*y[Bj]*(dot(Bi, Bj) + 1);
+				double Q_ij;
+				if (!kept(i, j, Q_ij))
+				{
+					if (!scattered)
+					{
+						scatter(Bi, dense);
+						scattered = true;
+					}
+					TM_COUNT(TM_KERNEL, 1);
+					Q_ij = y[Bi]*y[Bj]*(dot(Bj, dense) + 1);
+				}
+				qp.Q[i*qp.n+j] = qp.Q[j*qp.n+i] = Q_ij;
 				qp.p[i] -= qp.Q[i*qp.n+j]*alpha[Bj];
 				qp.p[j] -= qp.Q[j*qp.n+i]*alpha[Bi];
 			}
+			if (scattered)
+				gather(Bi, dense);
 		}
+		keep_subproblem(q);
 
-		solvebqp(&qp);
+		solve_bqp(&qp);
+		TM_STOP(TM_ALPHA, t_alpha);
+		TM_START(t_gradient);
 
 		// update G
 
@@ -2363,16 +3486,21 @@ int Solver_B_linear::Solve(int l, svm_node * const * x_, double *b_, schar *y_,
 				w[0] += yalpha;
 			}
 		}
-		for(j=0;j<active_size;j++)
-		{
-			double sum = 0;
-			for (const svm_node *px = x[j];px->index != -1;px++)
-				sum += w[px->index]*px->value;
-			sum += w[0];
-			G[j] = y[j]*sum + b[j];
-		}
+		compute_gradient(0, active_size);
+		TM_STOP(TM_GRADIENT, t_gradient);
+
+	}
+	TM_COUNT(TM_ITER, iter);
 
+	if(iter >= max_iter)
+		status = SOLVE_MAX_ITER;
+	if(status != SOLVE_CONVERGED)
+	{
+		reconstruct_gradient();
+		active_size = l;
 	}
+	if(budget)
+		budget->spend(iter, status);
 
 	// calculate objective value
 	{
@@ -2411,22 +3539,398 @@ int Solver_B_linear::Solve(int l, svm_node * const * x_, double *b_, schar *y_,
 	delete[] y;
 	delete[] b;
 	delete[] x;
+	delete[] x_square;
+	delete[] dense;
 
-	delete[] working_set;
-	delete[] old_working_set;
-	delete[] qp.p;
-	delete[] qp.C;
-	delete[] qp.x;
-	delete[] qp.Q;
+	delete_subproblem(qp);
+
+	return iter;
+}
+
+
+//
+// Dual coordinate descent for the linear BSVM problems
+//
+//	min 0.5(\alpha^T Q \alpha) + b^T \alpha
+//
+//		0 <= alpha_i <= C_i,  Q_ij = y_i y_j (x_i^T x_j + 1)
+//
+// as in LIBLINEAR: one exact coordinate step per variable, in random
+// order, against w = sum_i alpha_i y_i x_i with w[0] as the bias, and
+// shrinking of variables that stay at a bound.  w must match alpha on
+// entry.
+//
+#define DCD_MAX_ITER 1000
+
+class Solver_DCD {
+public:
+	Solver_DCD(Budget *budget_ = NULL) { budget = budget_; };
+
+	int Solve(int l, svm_node * const * x, double *b, schar *y,
+	double *alpha, double *w, double Cp, double Cn, double eps,
+	Solver_B::SolutionInfo* si, int shrinking);
+private:
+	Budget *budget;
+
+	static double dot(const svm_node *px, const double *w)
+	{
+		double sum = w[0];
+		for (;px->index != -1;px++)
+			sum += w[px->index]*px->value;
+		return sum;
+	}
+};
+
+int Solver_DCD::Solve(int l, svm_node * const * x, double *b, schar *y,
+	double *alpha, double *w, double Cp, double Cn, double eps,
+	Solver_B::SolutionInfo* si, int shrinking)
+{
+	double *QD = new double[l];
+	int *index = new int[l];
+	int i, s, iter = 0, active_size = l;
+	int max_iter = DCD_MAX_ITER;
+	int status = SOLVE_CONVERGED;
+	unsigned int seed = 1;	// the order is pseudo-random but reproducible
+
+	// projected gradient bounds of the previous pass, for shrinking
+	double PGmax_old = INF, PGmin_old = -INF;
+
+	if(budget)
+		max_iter = min(max_iter, budget->iter_left());
+	TM_COUNT(TM_RUN, 1);
+
+	for(i=0;i<l;i++)
+	{
+		QD[i] = 1;
+		for (const svm_node *px = x[i];px->index != -1;px++)
+			QD[i] += px->value*px->value;
+		index[i] = i;
+	}
+
+	while(iter < max_iter)
+	{
+		double PGmax_new = -INF, PGmin_new = INF;
+
+		for(i=0;i<active_size;i++)
+		{
+			seed = seed*1103515245 + 12345;
+			swap(index[i], index[i+(seed>>8)%(active_size-i)]);
+		}
+
+		TM_START(t_alpha);
+		for(s=0;s<active_size;s++)
+		{
+			i = index[s];
+			double C_i = y[i] > 0 ? Cp : Cn;
+			double G = y[i]*dot(x[i], w) + b[i];
+			double PG = 0;
+
+			if(alpha[i] <= 0)
+			{
+				if(shrinking && G > PGmax_old)
+				{
+					active_size--;
+					swap(index[s], index[active_size]);
+					s--;
+					continue;
+				}
+				if(G < 0)
+					PG = G;
+			}
+			else if(alpha[i] >= C_i)
+			{
+				if(shrinking && G < PGmin_old)
+				{
+					active_size--;
+					swap(index[s], index[active_size]);
+					s--;
+					continue;
+				}
+				if(G > 0)
+					PG = G;
+			}
+			else
+				PG = G;
+
+			PGmax_new = max(PGmax_new, PG);
+			PGmin_new = min(PGmin_new, PG);
+
+			if(fabs(PG) > 1e-12)
+			{
+				double alpha_old = alpha[i];
+				alpha[i] = min(max(alpha[i] - G/QD[i], 0.0), C_i);
+				double d = (alpha[i] - alpha_old)*y[i];
+				for (const svm_node *px = x[i];px->index != -1;px++)
+					w[px->index] += d*px->value;
+				w[0] += d;
+			}
+		}
+		TM_STOP(TM_ALPHA, t_alpha);
+		++iter;
+
+		if(iter % 10 == 0)
+		{
+			TM_TRACE(iter, active_size);
+			if(budget && (status = budget->poll()) != SOLVE_CONVERGED)
+				break;
+		}
+
+		if(max(PGmax_new, -PGmin_new) < eps)
+		{
+			if(active_size == l)
+				break;
+			// check the shrunken variables before stopping
+			TM_COUNT(TM_UNSHRINK, 1);
+			active_size = l;
+			PGmax_old = INF;
+			PGmin_old = -INF;
+			continue;
+		}
+		PGmax_old = PGmax_new <= 0 ? INF : PGmax_new;
+		PGmin_old = PGmin_new >= 0 ? -INF : PGmin_new;
+	}
+	TM_COUNT(TM_ITER, iter);
+
+	if(iter >= max_iter)
+		status = (max_iter < DCD_MAX_ITER)? SOLVE_MAX_ITER : SOLVE_MAX_EPOCHS;
+	if(budget)
+		budget->spend(iter, status);
+
+	// calculate objective value
+	{
+		double v = 0;
+		for(i=0;i<l;i++)
+			if(alpha[i] != 0)
+				v += alpha[i] * (y[i]*dot(x[i], w) + 2*b[i]);
+		si->obj = v/2;
+	}
+
+	si->upper_bound = new double[2];
+	si->upper_bound[0] = Cp;
+	si->upper_bound[1] = Cn;
+
+	delete[] QD;
+	delete[] index;
+	return iter;
+}
+
+//
+// Truncated Newton method for the primal of the L2-loss linear SVM
+//
+//	min 0.5(w^T w) + sum_i C_i max(0, 1 - y_i w^T x_i)^2
+//
+// and of the L2-loss epsilon-insensitive SVR
+//
+//	min 0.5(w^T w) + sum_i C_i max(0, |w^T x_i - y_i| - p)^2
+//
+// with w[0] as the bias, as in Solver_B_linear.  dtron runs without
+// bounds on the n+1 weights and sees the Hessian
+//
+//	I + 2 sum_{i in I} C_i x_i x_i^T,  I = { i : loss_i > 0 }
+//
+// only through products with the sparse rows of I, so that neither Q
+// nor the Hessian is ever formed.  On exit alpha holds the dual
+// coefficients, w = sum_i alpha_i x_i.
+//
+#define PRIMAL_MAX_FEV 1000
+
+class Solver_Primal {
+public:
+	Solver_Primal(Budget *budget_ = NULL) { budget = budget_; };
+
+	int Solve(int l, int n, svm_node * const * x, const double *y,
+	const double *C, double p, bool svr, double *alpha, double eps,
+	Solver_B::SolutionInfo* si);
+private:
+	Budget *budget;
+	int l, status, max_fev;
+	svm_node * const *x;
+	const double *y, *C;
+	double p;
+	bool svr;
+	double *z;	// w^T x_i at the last fv
+	int *I, sizeI;	// examples with nonzero loss at the last grad
+
+	static double dot(const svm_node *px, const double *w)
+	{
+		double sum = w[0];
+		for (;px->index != -1;px++)
+			sum += w[px->index]*px->value;
+		return sum;
+	}
+
+	// loss_i = C_i e_i^2
+	double e(int i) const
+	{
+		if (!svr)
+			return y[i]*min(y[i]*z[i] - 1, 0.0);
+		double d = z[i] - y[i];
+		return d > p ? d - p : (d < -p ? d + p : 0);
+	}
+
+	static int fv(struct tron_ctx *ctx, int n, double *w, double *f);
+	static void grad(struct tron_ctx *ctx, int n, double *w, double *g);
+	static void hv(struct tron_ctx *ctx, int n, double *v, double *Hv);
+};
+
+int Solver_Primal::fv(struct tron_ctx *ctx, int n, double *w, double *f)
+{
+	Solver_Primal *s = (Solver_Primal *) ctx->prob;
+	double v = 0;
+	int i;
+
+	for(i=0;i<n;i++)
+		v += w[i]*w[i];
+	v /= 2;
+	for(i=0;i<s->l;i++)
+	{
+		s->z[i] = dot(s->x[i], w);
+		double ei = s->e(i);
+		v += s->C[i]*ei*ei;
+	}
+	*f = v;
+
+	// dtron gives up as soon as fv reports too many evaluations
+	++ctx->nfev;
+	TM_COUNT(TM_ITER, 1);
+	if(s->budget && ctx->nfev % 10 == 0 &&
+	   (s->status = s->budget->poll()) != SOLVE_CONVERGED)
+		return s->max_fev + 1;
+	return ctx->nfev;
+}
+
+void Solver_Primal::grad(struct tron_ctx *ctx, int n, double *w, double *g)
+{
+	Solver_Primal *s = (Solver_Primal *) ctx->prob;
+	double *D = ctx->diag;
+	int i;
+
+	for(i=0;i<n;i++)
+	{
+		g[i] = w[i];
+		D[i] = 1;
+	}
+	s->sizeI = 0;
+	for(i=0;i<s->l;i++)
+	{
+		double ei = s->e(i);
+		if (ei == 0)
+			continue;
+		s->I[s->sizeI++] = i;
+		double d = 2*s->C[i]*ei;
+		for (const svm_node *px = s->x[i];px->index != -1;px++)
+		{
+			g[px->index] += d*px->value;
+			D[px->index] += 2*s->C[i]*px->value*px->value;
+		}
+		g[0] += d;
+		D[0] += 2*s->C[i];
+	}
+}
+
+void Solver_Primal::hv(struct tron_ctx *ctx, int n, double *v, double *Hv)
+{
+	Solver_Primal *s = (Solver_Primal *) ctx->prob;
+	int i, k;
 
-	return iter;
+	for(i=0;i<n;i++)
+		Hv[i] = v[i];
+	for(k=0;k<s->sizeI;k++)
+	{
+		i = s->I[k];
+		double d = 2*s->C[i]*dot(s->x[i], v);
+		for (const svm_node *px = s->x[i];px->index != -1;px++)
+			Hv[px->index] += d*px->value;
+		Hv[0] += d;
+	}
 }
 
+int Solver_Primal::Solve(int l, int n, svm_node * const * x, const double *y,
+	const double *C, double p, bool svr, double *alpha, double eps,
+	Solver_B::SolutionInfo* si)
+{
+	int i;
+	double f;
+	struct tron_ctx ctx;
+
+	this->l = l;
+	this->x = x;
+	this->y = y;
+	this->C = C;
+	this->p = p;
+	this->svr = svr;
+	status = SOLVE_CONVERGED;
+	max_fev = PRIMAL_MAX_FEV;
+	if(budget)
+		max_fev = min(max_fev, budget->iter_left());
+	TM_COUNT(TM_RUN, 1);
+
+	n++;	// w[0] is the bias
+	double *w = new double[n];
+	double *xl = new double[n];
+	double *xu = new double[n];
+	double *D = new double[n];
+	double *work = new double[TRON_WORKSIZE(n)];
+	int *iwork = new int[n];
+	z = new double[l];
+	I = new int[l];
+	for(i=0;i<n;i++)
+	{
+		w[i] = 0;
+		xl[i] = -INF;
+		xu[i] = INF;
+	}
+
+	ctx.fv = fv;
+	ctx.grad = grad;
+	ctx.hv = hv;
+	ctx.diag = D;
+	ctx.A = ctx.g0 = NULL;
+	ctx.prob = this;
+	ctx.nfev = 0;
+	ctx.lambda = 0;
+	ctx.t = NULL;
+
+	// w is also sum_i alpha_i x_i less the gradient, so stop on
+	// ||g||_inf <= eps rather than relative to the gradient at w = 0
+	fv(&ctx, n, w, &f);
+	grad(&ctx, n, w, work);
+	ctx.nfev = 0;
+	double gnorm0 = 0;
+	for(i=0;i<n;i++)
+		gnorm0 += work[i]*work[i];
+	gnorm0 = sqrt(gnorm0);
+	dtron(&ctx, n, w, xl, xu, gnorm0 > 0 ? eps/gnorm0 : 0, 1e-12, 0,
+	      -1e+32, max_fev, 0.1, work, iwork);
+
+	if(status == SOLVE_CONVERGED && ctx.nfev > max_fev)
+		status = (max_fev < PRIMAL_MAX_FEV)? SOLVE_MAX_ITER : SOLVE_MAX_EPOCHS;
+	if(budget)
+		budget->spend(ctx.nfev, status);
+
+	// the dual solution is -2 C_i e_i at the final w, and the dual
+	// objective equals minus the primal one
+	fv(&ctx, n, w, &f);
+	for(i=0;i<l;i++)
+		alpha[i] = -2*C[i]*e(i);
+	si->obj = -f;
+	si->upper_bound = NULL;
+
+	delete[] w;
+	delete[] xl;
+	delete[] xu;
+	delete[] D;
+	delete[] work;
+	delete[] iwork;
+	delete[] z;
+	delete[] I;
+	return ctx.nfev;
+}
 
 class Solver_MB : public Solver_B
 {
 public:
-	Solver_MB() {};
+	Solver_MB(Budget *budget_ = NULL): Solver_B(budget_) {};
 	~Solver_MB() {};
 	void Solve(int l, const Kernel& Q, double lin, double *alpha_,
 	short *y_, double *C, double eps, SolutionInfo* si,
@@ -2441,15 +3945,49 @@ private:
 	int nr_class;
 	int *start1, *start2;
 
+	// Q_ij is yyy(...)*K(real_i[i], real_j[j]), nonzero only for the
+	// blocks coupled[b*ncoupled..] of the block b = yy[i]*nr_class+y[i],
+	// with coupling[b*ncoupled..] = yyy(...).  A gradient update sums
+	// the coefficients of all variables of one real sample per block
+	// and then passes once over its kernel column.
+	int ncoupled;
+	int *coupled;
+	schar *coupling;
+	double *block_coef;
+	char *block_touched;
+	int *touched, ntouched;
+	schar *grouped;
+
 	double get_C(int i)
 	{
 		return C[y[i]];
 	}
+	int block(int i) const
+	{
+		return yy[i]*nr_class+y[i];
+	}
+	void couple(int b, double f)
+	{
+		const int *cb = &coupled[b*ncoupled];
+		const schar *cc = &coupling[b*ncoupled];
+		for (int k=0;k<ncoupled;k++)
+		{
+			if (!block_touched[cb[k]])
+			{
+				block_touched[cb[k]] = 1;
+				touched[ntouched++] = cb[k];
+			}
+			block_coef[cb[k]] += cc[k]*f;
+		}
+	}
+	void add_coupled(double *v, const int *start, const Qfloat *Q_r);
+	void clear_coupled();
 	void swap_index(int i, int j);
 	void reconstruct_gradient();
-	void shrink_one(int k);
-	void unshrink_one(int k);
+	void rearrange(const char *to_active);
+	void do_shrinking();
 	void initial_index_table(int *);
+	void initial_coupling();
 	int yyy(int yi, int yyi, int yj, int yyj) const
 	{
 		int xx = 0;
@@ -2469,6 +4007,7 @@ void Solver_MB::swap_index(int i, int j)
 {
 	if (i == j)
 		return;
+	last_q = 0;
 	swap(y[i],y[j]);
 	swap(yy[i],yy[j]);
 	swap(G[i],G[j]);
@@ -2479,6 +4018,63 @@ void Solver_MB::swap_index(int i, int j)
 	swap(G_bar[i],G_bar[j]);
 }
 
+void Solver_MB::initial_coupling()
+{
+	int nb = nr_class*nr_class, b, c;
+
+	ncoupled = 4*nr_class - 6;
+	coupled = new int[nb*ncoupled];
+	coupling = new schar[nb*ncoupled];
+	for (b=0;b<nb;b++)
+	{
+		int k = 0, y_b = b%nr_class, yy_b = b/nr_class;
+		if (y_b == yy_b)
+			continue;
+		for (c=0;c<nb;c++)
+		{
+			int y_c = c%nr_class, yy_c = c/nr_class, v;
+			if (y_c == yy_c || (v = yyy(y_b, yy_b, y_c, yy_c)) == 0)
+				continue;
+			coupled[b*ncoupled+k] = c;
+			coupling[b*ncoupled+k] = (schar) v;
+			k++;
+		}
+	}
+
+	block_coef = new double[nb];
+	block_touched = new char[nb];
+	touched = new int[nb];
+	for (b=0;b<nb;b++)
+	{
+		block_coef[b] = 0;
+		block_touched[b] = 0;
+	}
+	ntouched = 0;
+}
+
+// v[j] += block_coef[b]*Q_r[real_i[j]] for j in [start[b], start[b+1])
+// of each touched block b
+void Solver_MB::add_coupled(double *v, const int *start, const Qfloat *Q_r)
+{
+	for (int k=0;k<ntouched;k++)
+	{
+		int b = touched[k], ub = start[b+1];
+		double f = block_coef[b];
+		for (int j=start[b];j<ub;j++)
+			v[j] += f*Q_r[real_i[j]];
+	}
+}
+
+void Solver_MB::clear_coupled()
+{
+	for (int k=0;k<ntouched;k++)
+	{
+		block_coef[touched[k]] = 0;
+		block_touched[touched[k]] = 0;
+	}
+	ntouched = 0;
+}
+
 void Solver_MB::initial_index_table(int *count)
 {
 	int i, j, k, p, q;
@@ -2512,44 +4108,35 @@ void Solver_MB::reconstruct_gradient()
 	// reconstruct inactive elements of G from G_bar and free variables
 
 	if(active_size == l) return;
+	TM_COUNT(TM_UNSHRINK, 1);
 
-	int i, j;
+	int i, r;
 	for(i=active_size;i<l;i++)
 		G[i] = G_bar[i] + lin;
-	
-	for(i=0;i<active_size;i++)
+
+	// the free variables of each real sample, linked through next
+	int *head = new int[real_l];
+	int *next = new int[active_size];
+	for(r=0;r<real_l;r++)
+		head[r] = -1;
+	for(i=active_size-1;i>=0;i--)
 		if(is_free(i))
 		{
-			const Qfloat *Q_i = Q->get_Q(real_i[i],real_l);
-			double alpha_i = alpha[i], t;
-			int y_i = y[i], yy_i = yy[i], ub, k;
-			
-			t = 2*alpha_i;
-			ub = start2[yy_i*nr_class+y_i+1];
-			for (j=start2[yy_i*nr_class+y_i];j<ub;j++)
-				G[j] += t*Q_i[real_i[j]];
-			ub = start2[y_i*nr_class+yy_i+1];	
-			for (j=start2[y_i*nr_class+yy_i];j<ub;j++)
-				G[j] -= t*Q_i[real_i[j]];
-					
-			for (k=0;k<nr_class;k++)
-				if (k != y_i && k != yy_i)
-				{
-					ub = start2[k*nr_class+y_i+1];
-					for (j=start2[k*nr_class+y_i];j<ub;j++)
-						G[j] += alpha_i*Q_i[real_i[j]];
-					ub = start2[yy_i*nr_class+k+1];
-					for (j=start2[yy_i*nr_class+k];j<ub;j++)
-						G[j] += alpha_i*Q_i[real_i[j]];
-							
-					ub = start2[y_i*nr_class+k+1];
-					for (j=start2[y_i*nr_class+k];j<ub;j++)
-						G[j] -= alpha_i*Q_i[real_i[j]];
-					ub = start2[k*nr_class+yy_i+1];
-					for (j=start2[k*nr_class+yy_i];j<ub;j++)
-						G[j] -= alpha_i*Q_i[real_i[j]];	
-				}			
+			next[i] = head[real_i[i]];
+			head[real_i[i]] = i;
 		}
+
+	for(r=0;r<real_l;r++)
+		if(head[r] >= 0)
+		{
+			for(i=head[r];i>=0;i=next[i])
+				couple(block(i), alpha[i]);
+			add_coupled(G, start2, Q->get_Q(r,real_l));
+			clear_coupled();
+		}
+
+	delete[] head;
+	delete[] next;
 }
 
 void Solver_MB::Solve(int l, const Kernel& Q, double lin, double *alpha_,
@@ -2583,17 +4170,14 @@ void Solver_MB::Solve(int l, const Kernel& Q, double lin, double *alpha_,
 	real_i = new int[l];
 	start1 = new int[nr_class*nr_class+1];
 	start2 = new int[nr_class*nr_class+1];
+	grouped = new schar[qpsize];
 
 	initial_index_table(count);
+	initial_coupling();
 
 	BQP qp;
-	working_set = new int[qpsize];
-	old_working_set = new int[qpsize];
+	new_subproblem(qp);
 	qp.eps = eps/10;
-	qp.C = new double[qpsize];
-	qp.x = new double[qpsize];
-	qp.p = new double[qpsize];
-	qp.Q = new double[qpsize*qpsize];
 
 	// initialize gradient
 	{
@@ -2609,54 +4193,16 @@ void Solver_MB::Solve(int l, const Kernel& Q, double lin, double *alpha_,
 		for (i=0;i<l;i++)
 			if (!is_lower_bound(i))
 			{
-				Qfloat *Q_i = Q.get_Q(real_i[i], real_l);
-				double alpha_i = alpha[i];
-				double C_i = get_C(i);
-				int y_i = y[i], yy_i = yy[i], ub, j, k;
-				
-				ub = start1[yy_i*nr_class+y_i+1];
-				for (j=start1[yy_i*nr_class+y_i];j<ub;j++)
-					G[j] += alpha_i*Q_i[real_i[j]];
-				if (shrinking && is_upper_bound(i)) 
-					for (j=start1[yy_i*nr_class+y_i];j<ub;j++)
-						G_bar[j] += C_i*Q_i[real_i[j]];				
-					
-				ub = start1[y_i*nr_class+yy_i+1];	
-				for (j=start1[y_i*nr_class+yy_i];j<ub;j++)
-					G[j] -= alpha_i*Q_i[real_i[j]];
-				if (shrinking && is_upper_bound(i)) 
-					for (j=start1[y_i*nr_class+yy_i];j<ub;j++)
-						G_bar[j] += C_i*Q_i[real_i[j]];					
-					
-				for (k=0;k<nr_class;k++)
-					if (k != y_i && k != yy_i)
-					{
-						ub = start1[k*nr_class+y_i+1];
-						for (j=start1[k*nr_class+y_i];j<ub;j++)
-							G[j] += alpha_i*Q_i[real_i[j]];
-						if (shrinking && is_upper_bound(i)) 
-							for (j=start1[k*nr_class+y_i];j<ub;j++)
-								G_bar[j] += C_i*Q_i[real_i[j]];							
-						ub = start1[yy_i*nr_class+k+1];
-						for (j=start1[yy_i*nr_class+k];j<ub;j++)
-							G[j] += alpha_i*Q_i[real_i[j]];
-						if (shrinking && is_upper_bound(i)) 
-							for (j=start1[yy_i*nr_class+k];j<ub;j++)
-								G_bar[j] += C_i*Q_i[real_i[j]];							
-							
-						ub = start1[y_i*nr_class+k+1];
-						for (j=start1[y_i*nr_class+k];j<ub;j++)
-							G[j] -= alpha_i*Q_i[real_i[j]];
-						if (shrinking && is_upper_bound(i)) 
-							for (j=start1[y_i*nr_class+k];j<ub;j++)
-								G_bar[j] += C_i*Q_i[real_i[j]];							
-						ub = start1[k*nr_class+yy_i+1];
-						for (j=start1[k*nr_class+yy_i];j<ub;j++)
-							G[j] -= alpha_i*Q_i[real_i[j]];
-						if (shrinking && is_upper_bound(i)) 
-							for (j=start1[k*nr_class+yy_i];j<ub;j++)
-								G_bar[j] += C_i*Q_i[real_i[j]];							
-					}
+				const Qfloat *Q_i = Q.get_Q(real_i[i], real_l);
+				couple(block(i), alpha[i]);
+				add_coupled(G, start1, Q_i);
+				clear_coupled();
+				if (shrinking && is_upper_bound(i))
+				{
+					couple(block(i), get_C(i));
+					add_coupled(G_bar, start1, Q_i);
+					clear_coupled();
+				}
 			}
 	}
 
@@ -2664,19 +4210,26 @@ void Solver_MB::Solve(int l, const Kernel& Q, double lin, double *alpha_,
 
 	int iter = 0;
 	int counter = min(l*2/qpsize,2000/qpsize)+1;
+	int max_iter = budget ? budget->iter_left() : INT_MAX;
+	int status = SOLVE_CONVERGED;
+	TM_COUNT(TM_RUN, 1);
 
-	while(1)
+	while(iter < max_iter)
 	{
 		// show progress and do shrinking
 
 		if(--counter == 0)
 		{
 			counter = min(l*2/qpsize, 2000/qpsize);
-			if(shrinking) do_shrinking();
+			if(shrinking) TM_SHRINKING(active_size, do_shrinking());
 			//	info(".");
+			TM_TRACE(iter, active_size);
+			if(budget && (status = budget->poll()) != SOLVE_CONVERGED)
+				break;
 		}
 
 		int i,j,q;
+		TM_START(t_select);
 		if (select_working_set(q) < eps)
 		{
 			// reconstruct the whole gradient
@@ -2720,6 +4273,7 @@ void Solver_MB::Solve(int l, const Kernel& Q, double lin, double *alpha_,
 			delete[] G_bar0;
 
 			initial_index_table(count);
+			last_q = 0;
 		}
 		
 		if (counter == min(l*2/qpsize, 2000/qpsize))
@@ -2739,13 +4293,17 @@ void Solver_MB::Solve(int l, const Kernel& Q, double lin, double *alpha_,
 		for (i=0;i<qpsize;i++)
 		  old_working_set[i] = working_set[i];
 
+		TM_STOP(TM_SELECT, t_select);
 		++iter;	
 
-		// construct subproblem
-		Qfloat **QB;
-		QB = new Qfloat *[q];
+		// construct subproblem, fetching only the columns of
+		// variables that are new to the working set
+		reuse_subproblem(qp, q);
+		TM_START(t_fetch);
 		for (i=0;i<q;i++)
-			QB[i] = Q.get_Q(real_i[working_set[i]], real_l);
+			QB[i] = last_pos[i] < 0 ? Q.get_Q(real_i[working_set[i]], real_l) : NULL;
+		TM_STOP(TM_FETCH, t_fetch);
+		TM_START(t_alpha);
 		qp.n = q;
 		for (i=0;i<qp.n;i++)
 			qp.p[i] = G[working_set[i]];
@@ -2754,176 +4312,104 @@ void Solver_MB::Solve(int l, const Kernel& Q, double lin, double *alpha_,
 			int Bi = working_set[i], y_Bi = y[Bi], yy_Bi = yy[Bi];
 			qp.x[i] = alpha[Bi];
 			qp.C[i] = get_C(Bi);
-			qp.Q[i*qp.n+i] = yyy(y_Bi, yy_Bi, y_Bi, yy_Bi)*
-			QB[i][real_i[Bi]];
+			if (!kept(i, i, qp.Q[i*qp.n+i]))
+				qp.Q[i*qp.n+i] = yyy(y_Bi, yy_Bi, y_Bi, yy_Bi)*
+				QB[i][real_i[Bi]];
 			qp.p[i] -= qp.Q[i*qp.n+i]*alpha[Bi];
 			for (j=i+1;j<qp.n;j++)
 			{			
 				int Bj = working_set[j];
-				qp.Q[i*qp.n+j] = qp.Q[j*qp.n+i] = 
-				yyy(y_Bi, yy_Bi, y[Bj], yy[Bj])*QB[i][real_i[Bj]];
+				double Q_ij;
+				if (!kept(i, j, Q_ij))
+					Q_ij = yyy(y_Bi, yy_Bi, y[Bj], yy[Bj])*
+					(QB[i] ? QB[i][real_i[Bj]] : QB[j][real_i[Bi]]);
+				qp.Q[i*qp.n+j] = qp.Q[j*qp.n+i] = Q_ij;
 				qp.p[i] -= qp.Q[i*qp.n+j]*alpha[Bj];
 				qp.p[j] -= qp.Q[j*qp.n+i]*alpha[Bi];
 			}
 		}
+		keep_subproblem(q);
 
-		solvebqp(&qp);
+		solve_bqp(&qp);
+		TM_STOP(TM_ALPHA, t_alpha);
+		TM_START(t_gradient);
 
-		// update G
+		// update G, passing once over the column of each real
+		// sample in the working set
 
 		for(i=0;i<q;i++)
-		{
-			int Bi = working_set[i];
-			double d = qp.x[i] - alpha[working_set[i]];
-			if(fabs(d) > 1e-12)
+			grouped[i] = 0;
+		for(i=0;i<q;i++)
+			if (!grouped[i])
 			{
-				alpha[Bi] = qp.x[i];
-				Qfloat *QB_i = QB[i];
-				int y_Bi = y[Bi], yy_Bi = yy[Bi], ub, k;
-
-				double t = 2*d;
-				ub = start1[yy_Bi*nr_class+y_Bi+1];
-				for (j=start1[yy_Bi*nr_class+y_Bi];j<ub;j++)
-					G[j] += t*QB_i[real_i[j]];
-				ub = start1[y_Bi*nr_class+yy_Bi+1];	
-				for (j=start1[y_Bi*nr_class+yy_Bi];j<ub;j++)
-					G[j] -= t*QB_i[real_i[j]];
-					
-				for (k=0;k<nr_class;k++)
-					if (k != y_Bi && k != yy_Bi)
+				int r = real_i[working_set[i]], first = -1;
+				for(j=i;j<q;j++)
+				{
+					int Bj = working_set[j];
+					if (grouped[j] || real_i[Bj] != r)
+						continue;
+					grouped[j] = 1;
+					double d = qp.x[j] - alpha[Bj];
+					if(fabs(d) > 1e-12)
 					{
-						ub = start1[k*nr_class+y_Bi+1];
-						for (j=start1[k*nr_class+y_Bi];j<ub;j++)
-							G[j] += d*QB_i[real_i[j]];
-						ub = start1[yy_Bi*nr_class+k+1];
-						for (j=start1[yy_Bi*nr_class+k];j<ub;j++)
-							G[j] += d*QB_i[real_i[j]];
-							
-						ub = start1[y_Bi*nr_class+k+1];
-						for (j=start1[y_Bi*nr_class+k];j<ub;j++)
-							G[j] -= d*QB_i[real_i[j]];
-						ub = start1[k*nr_class+yy_Bi+1];
-						for (j=start1[k*nr_class+yy_Bi];j<ub;j++)
-							G[j] -= d*QB_i[real_i[j]];	
+						alpha[Bj] = qp.x[j];
+						couple(block(Bj), d);
+						if (first < 0 || QB[j])
+							first = j;
 					}
+				}
+				if (first < 0)
+					continue;
+				if (!QB[first])
+					QB[first] = Q.get_Q(r, real_l);
+				add_coupled(G, start1, QB[first]);
+				clear_coupled();
 			}
-		}
 
-		// update alpha_status and G_bar
+		// update alpha_status and G_bar, grouped[i] is the sign of
+		// the change of C_i in G_bar
 
 		for (i=0;i<q;i++)
 		{
 			int Bi = working_set[i];
 			bool u = is_upper_bound(Bi);
 			update_alpha_status(Bi);
-			if (!shrinking)
-				continue;
-			if (u != is_upper_bound(Bi))
+			grouped[i] = shrinking && u != is_upper_bound(Bi) ? (u ? -1 : 1) : 0;
+		}
+		for(i=0;i<q;i++)
+			if (grouped[i])
 			{
-				Qfloat *QB_i = QB[i];
-				double C_i = qp.C[i], t = 2*C_i;
-				int ub, y_Bi = y[Bi], yy_Bi = yy[Bi], k;
-				if (u)
-				{
-					ub = start1[yy_Bi*nr_class+y_Bi+1];
-					for (j=start1[yy_Bi*nr_class+y_Bi];j<ub;j++)
-						G_bar[j] -= t*QB_i[real_i[j]];
-					ub = start1[y_Bi*nr_class+yy_Bi+1];	
-					for (j=start1[y_Bi*nr_class+yy_Bi];j<ub;j++)
-						G_bar[j] += t*QB_i[real_i[j]];
-
-					ub = start2[yy_Bi*nr_class+y_Bi+1];
-					for (j=start2[yy_Bi*nr_class+y_Bi];j<ub;j++)
-						G_bar[j] -= t*QB_i[real_i[j]];
-					ub = start2[y_Bi*nr_class+yy_Bi+1];	
-					for (j=start2[y_Bi*nr_class+yy_Bi];j<ub;j++)
-						G_bar[j] += t*QB_i[real_i[j]];
-					
-					for (k=0;k<nr_class;k++)
-						if (k != y_Bi && k != yy_Bi)
-						{
-							ub = start1[k*nr_class+y_Bi+1];
-							for (j=start1[k*nr_class+y_Bi];j<ub;j++)
-								G_bar[j] -= C_i*QB_i[real_i[j]];
-							ub = start1[yy_Bi*nr_class+k+1];
-							for (j=start1[yy_Bi*nr_class+k];j<ub;j++)
-								G_bar[j] -= C_i*QB_i[real_i[j]];
-							
-							ub = start1[y_Bi*nr_class+k+1];
-							for (j=start1[y_Bi*nr_class+k];j<ub;j++)
-								G_bar[j] += C_i*QB_i[real_i[j]];
-							ub = start1[k*nr_class+yy_Bi+1];
-							for (j=start1[k*nr_class+yy_Bi];j<ub;j++)
-								G_bar[j] += C_i*QB_i[real_i[j]];
-
-							ub = start2[k*nr_class+y_Bi+1];
-							for (j=start2[k*nr_class+y_Bi];j<ub;j++)
-								G_bar[j] -= C_i*QB_i[real_i[j]];
-							ub = start2[yy_Bi*nr_class+k+1];
-							for (j=start2[yy_Bi*nr_class+k];j<ub;j++)
-								G_bar[j] -= C_i*QB_i[real_i[j]];
-							
-							ub = start2[y_Bi*nr_class+k+1];
-							for (j=start2[y_Bi*nr_class+k];j<ub;j++)
-								G_bar[j] += C_i*QB_i[real_i[j]];
-							ub = start2[k*nr_class+yy_Bi+1];
-							for (j=start2[k*nr_class+yy_Bi];j<ub;j++)
-								G_bar[j] += C_i*QB_i[real_i[j]];
-						}
-				}
-				else
+				int r = real_i[working_set[i]], first = -1;
+				for(j=i;j<q;j++)
 				{
-					ub = start1[yy_Bi*nr_class+y_Bi+1];
-					for (j=start1[yy_Bi*nr_class+y_Bi];j<ub;j++)
-						G_bar[j] += t*QB_i[real_i[j]];
-					ub = start1[y_Bi*nr_class+yy_Bi+1];	
-					for (j=start1[y_Bi*nr_class+yy_Bi];j<ub;j++)
-						G_bar[j] -= t*QB_i[real_i[j]];
-
-					ub = start2[yy_Bi*nr_class+y_Bi+1];
-					for (j=start2[yy_Bi*nr_class+y_Bi];j<ub;j++)
-						G_bar[j] += t*QB_i[real_i[j]];
-					ub = start2[y_Bi*nr_class+yy_Bi+1];	
-					for (j=start2[y_Bi*nr_class+yy_Bi];j<ub;j++)
-						G_bar[j] -= t*QB_i[real_i[j]];
-					
-					for (k=0;k<nr_class;k++)
-						if (k != y_Bi && k != yy_Bi)
-						{
-							ub = start1[k*nr_class+y_Bi+1];
-							for (j=start1[k*nr_class+y_Bi];j<ub;j++)
-								G_bar[j] += C_i*QB_i[real_i[j]];
-							ub = start1[yy_Bi*nr_class+k+1];
-							for (j=start1[yy_Bi*nr_class+k];j<ub;j++)
-								G_bar[j] += C_i*QB_i[real_i[j]];
-							
-							ub = start1[y_Bi*nr_class+k+1];
-							for (j=start1[y_Bi*nr_class+k];j<ub;j++)
-								G_bar[j] -= C_i*QB_i[real_i[j]];
-							ub = start1[k*nr_class+yy_Bi+1];
-							for (j=start1[k*nr_class+yy_Bi];j<ub;j++)
-								G_bar[j] -= C_i*QB_i[real_i[j]];
-
-							ub = start2[k*nr_class+y_Bi+1];
-							for (j=start2[k*nr_class+y_Bi];j<ub;j++)
-								G_bar[j] += C_i*QB_i[real_i[j]];
-							ub = start2[yy_Bi*nr_class+k+1];
-							for (j=start2[yy_Bi*nr_class+k];j<ub;j++)
-								G_bar[j] += C_i*QB_i[real_i[j]];
-							
-							ub = start2[y_Bi*nr_class+k+1];
-							for (j=start2[y_Bi*nr_class+k];j<ub;j++)
-								G_bar[j] -= C_i*QB_i[real_i[j]];
-							ub = start2[k*nr_class+yy_Bi+1];
-							for (j=start2[k*nr_class+yy_Bi];j<ub;j++)
-								G_bar[j] -= C_i*QB_i[real_i[j]];
-						}				
+					int Bj = working_set[j];
+					if (!grouped[j] || real_i[Bj] != r)
+						continue;
+					couple(block(Bj), grouped[j]*qp.C[j]);
+					grouped[j] = 0;
+					if (first < 0 || QB[j])
+						first = j;
 				}
+				if (!QB[first])
+					QB[first] = Q.get_Q(r, real_l);
+				add_coupled(G_bar, start1, QB[first]);
+				add_coupled(G_bar, start2, QB[first]);
+				clear_coupled();
 			}
-		}
 
-		delete[] QB;
+		TM_STOP(TM_GRADIENT, t_gradient);
+	}
+	TM_COUNT(TM_ITER, iter);
+
+	if(iter >= max_iter)
+		status = SOLVE_MAX_ITER;
+	if(status != SOLVE_CONVERGED)
+	{
+		reconstruct_gradient();
+		active_size = l;
 	}
+	if(budget)
+		budget->spend(iter, status);
 
 	// calculate objective value
 	{
@@ -2945,6 +4431,12 @@ void Solver_MB::Solve(int l, const Kernel& Q, double lin, double *alpha_,
 
 	delete[] start1;
 	delete[] start2;
+	delete[] grouped;
+	delete[] coupled;
+	delete[] coupling;
+	delete[] block_coef;
+	delete[] block_touched;
+	delete[] touched;
 	delete[] y;
 	delete[] yy;
 	delete[] real_i;
@@ -2955,43 +4447,91 @@ void Solver_MB::Solve(int l, const Kernel& Q, double lin, double *alpha_,
 	delete[] G;
 	delete[] G_bar;
 
-	delete[] working_set;
-	delete[] old_working_set;
-	delete[] qp.p;
-	delete[] qp.C;
-	delete[] qp.x;
-	delete[] qp.Q;
+	delete_subproblem(qp);
 }
 
-void Solver_MB::shrink_one(int k)
+// Moves the variables with to_active[i] set to the active part of their
+// block and the others to the shrunken part in one pass, keeping the
+// order within each block.
+void Solver_MB::rearrange(const char *to_active)
 {
-	int i, s = yy[k]*nr_class+y[k], t;
-	t = nr_class*nr_class;
-	for (i=s+1;i<=t;i++)
-		start1[i]--;
-	for (i=0;i<=s;i++)
-		start2[i]--;
-	swap_index(k, start1[s+1]);
-	for (i=s+1;i<t;i++)
-		swap_index(start1[i], start1[i+1]);
-	for (i=0;i<s;i++)
-		swap_index(start2[i], start2[i+1]);
+	int nb = nr_class*nr_class, b, j, p = 0;
+	int *perm = new int[l];
+	int *old1, *old2;
+
+	clone(old1, start1, nb+1);
+	clone(old2, start2, nb+1);
+	for (b=0;b<nb;b++)
+	{
+		start1[b] = p;
+		for (j=old1[b];j<old1[b+1];j++)
+			if (to_active[j])
+				perm[p++] = j;
+		for (j=old2[b];j<old2[b+1];j++)
+			if (to_active[j])
+				perm[p++] = j;
+	}
+	active_size = start1[nb] = p;
+	for (b=0;b<nb;b++)
+	{
+		start2[b] = p;
+		for (j=old1[b];j<old1[b+1];j++)
+			if (!to_active[j])
+				perm[p++] = j;
+		for (j=old2[b];j<old2[b+1];j++)
+			if (!to_active[j])
+				perm[p++] = j;
+	}
+	start2[nb] = l;
+
+	permute(y, perm, l);
+	permute(yy, perm, l);
+	permute(G, perm, l);
+	permute(alpha_status, perm, l);
+	permute(alpha, perm, l);
+	permute(active_set, perm, l);
+	permute(real_i, perm, l);
+	permute(G_bar, perm, l);
+	last_q = 0;
+
+	delete[] perm;
+	delete[] old1;
+	delete[] old2;
 }
 
-void Solver_MB::unshrink_one(int k)
+// the conditions of Solver_B::do_shrinking, applied to all variables at
+// once instead of moving them one at a time across the blocks
+void Solver_MB::do_shrinking()
 {
-	int i, s = yy[k]*nr_class+y[k], t;
-	swap_index(k, start2[s]);
-	for (i=s;i>0;i--)
-		swap_index(start2[i], start2[i-1]);
-	t = s + 1;
-	for (i=nr_class*nr_class;i>t;i--)
-		swap_index(start1[i], start1[i-1]);
-	t = nr_class*nr_class;
-	for (i=s+1;i<=t;i++)
-		start1[i]++;
-	for (i=0;i<=s;i++)
-		start2[i]++;
+	int k;
+
+	double Gm = select_working_set(k);
+	if (Gm < eps)
+		return;
+
+	// shrink
+
+	char *to_active = new char[l];
+	for(k=0;k<l;k++)
+		to_active[k] = k < active_size &&
+			!(is_lower_bound(k) && G[k] > Gm) &&
+			!(is_upper_bound(k) && G[k] < -Gm);
+	rearrange(to_active);
+
+	// unshrink, check all variables again before final iterations
+
+	if (!unshrinked && Gm <= eps*10)
+	{
+		unshrinked = true;
+		reconstruct_gradient();
+
+		for(k=0;k<l;k++)
+			to_active[k] = k < active_size ||
+				(is_lower_bound(k) && G[k] <= Gm) ||
+				(is_upper_bound(k) && G[k] >= -Gm);
+		rearrange(to_active);
+	}
+	delete[] to_active;
 }
 
 
@@ -3177,6 +4717,27 @@ private:
 //
 // Q matrices for various formulations
 //
+//
+// Single kernel values of all kernels, e.g. between the examples a
+// model was trained on and ones it was not
+//
+class Kernel_eval: public Kernel
+{
+public:
+	Kernel_eval(int l, svm_node * const * x, const svm_parameter& param)
+	:Kernel(l, x, param)
+	{
+	}
+
+	double operator()(int i, int j) const
+	{
+		return (this->*kernel_function)(i,j);
+	}
+
+	Qfloat *get_Q(int column, int len) const { return NULL; }
+	double *get_QD() const { return NULL; }
+};
+
 class SVC_Q: public Kernel
 { 
 public:
@@ -3188,6 +4749,11 @@ public:
 		QD = new double[prob.l];
 		for(int i=0;i<prob.l;i++)
 		  QD[i]= (double)(this->*kernel_function)(i,i);
+		// get_Q_batch fetches at most the columns of the working set,
+		// the pairs of Solver or qpsize samples of Solver_SPOC
+		nr_batch = max(2, max(param.qpsize, 2*param.npairs));
+		batch_data = new Qfloat *[nr_batch];
+		batch_start = new int[nr_batch];
 	}
 	
 	Qfloat *get_Q(int i, int len) const
@@ -3201,6 +4767,29 @@ public:
 		}
 		return data;
 	}
+
+	void get_Q_batch(const int *column, int n, int len, const Qfloat **out) const
+	{
+		if(n > nr_batch)
+		{
+			Kernel::get_Q_batch(column,n,len,out);
+			return;
+		}
+		// reserve all columns in the cache first, then fill them in parallel
+		Qfloat **data = batch_data;
+		int *start = batch_start;
+		for(int k=0;k<n;k++)
+			start[k] = cache->get_data(column[k],&data[k],len);
+#pragma omp parallel for schedule(dynamic,1)
+		for(int k=0;k<n;k++)
+		{
+			int i = column[k];
+			for(int j=start[k];j<len;j++)
+				data[k][j] = (Qfloat)(y[i]*y[j]*(this->*kernel_function)(i,j));
+		}
+		for(int k=0;k<n;k++)
+			out[k] = data[k];
+	}
 	
         double *get_QD() const
 	{
@@ -3220,11 +4809,16 @@ public:
 		delete[] y;
 		delete cache;
 		delete[] QD;
+		delete[] batch_data;
+		delete[] batch_start;
 	}
 private:
 	schar *y;
 	Cache *cache;
 	double *QD;
+	int nr_batch;
+	Qfloat **batch_data;
+	int *batch_start;
 };
 
 class ONE_CLASS_Q: public Kernel
@@ -3237,6 +4831,11 @@ public:
 	  QD = new double[prob.l];
 	  for(int i=0;i<prob.l;i++)
 	    QD[i]= (double)(this->*kernel_function)(i,i);	
+	  // get_Q_batch fetches at most the columns of the working set,
+	  // the pairs of Solver or qpsize samples of Solver_SPOC
+	  nr_batch = max(2, max(param.qpsize, 2*param.npairs));
+	  batch_data = new Qfloat *[nr_batch];
+	  batch_start = new int[nr_batch];
 	}
 	
 	Qfloat *get_Q(int i, int len) const
@@ -3250,6 +4849,29 @@ public:
 		}
 		return data;
 	}
+
+	void get_Q_batch(const int *column, int n, int len, const Qfloat **out) const
+	{
+		if(n > nr_batch)
+		{
+			Kernel::get_Q_batch(column,n,len,out);
+			return;
+		}
+		// reserve all columns in the cache first, then fill them in parallel
+		Qfloat **data = batch_data;
+		int *start = batch_start;
+		for(int k=0;k<n;k++)
+			start[k] = cache->get_data(column[k],&data[k],len);
+#pragma omp parallel for schedule(dynamic,1)
+		for(int k=0;k<n;k++)
+		{
+			int i = column[k];
+			for(int j=start[k];j<len;j++)
+				data[k][j] = (Qfloat)(this->*kernel_function)(i,j);
+		}
+		for(int k=0;k<n;k++)
+			out[k] = data[k];
+	}
 	
         double *get_QD() const
 	{
@@ -3267,10 +4889,15 @@ public:
 	{
 		delete cache;
 		delete[] QD;
+		delete[] batch_data;
+		delete[] batch_start;
 	}
 private:
 	Cache *cache;
         double *QD;
+	int nr_batch;
+	Qfloat **batch_data;
+	int *batch_start;
 };
 
 class SVR_Q: public Kernel
@@ -3293,8 +4920,11 @@ public:
 			QD[k]= (double)(this->*kernel_function)(k,k);
 			QD[k+l]=QD[k];
 		}
-		buffer[0] = new Qfloat[2*l];
-		buffer[1] = new Qfloat[2*l];
+		// get_Q_batch needs one buffer per column of the working set
+		nr_buffer = max(2, 2*param.npairs);
+		buffer = new Qfloat *[nr_buffer];
+		for(int k=0;k<nr_buffer;k++)
+			buffer[k] = new Qfloat[2*l];
 		next_buffer = 0;
 	}
 
@@ -3305,7 +4935,14 @@ public:
 		swap(QD[i],QD[j]);
 	}
 	
-	Qfloat *get_Q(int i, int len) const
+	int get_index(const int **index_, const schar **sign_) const
+	{
+		*index_ = index;
+		*sign_ = sign;
+		return l;
+	}
+
+	const Qfloat *get_K(int i) const
 	{
 		Qfloat *data;
 		int real_i = index[i];
@@ -3314,10 +4951,16 @@ public:
 			for(int j=0;j<l;j++)
 				data[j] = (Qfloat)(this->*kernel_function)(real_i,j);
 		}
+		return data;
+	}
+
+	Qfloat *get_Q(int i, int len) const
+	{
+		const Qfloat *data = get_K(i);
 
 		// reorder and copy
 		Qfloat *buf = buffer[next_buffer];
-		next_buffer = 1 - next_buffer;
+		next_buffer = (next_buffer+1) % nr_buffer;
 		schar si = sign[i];
 		for(int j=0;j<len;j++)
 			buf[j] = si * sign[j] * data[index[j]];
@@ -3334,8 +4977,9 @@ public:
 		delete cache;
 		delete[] sign;
 		delete[] index;
-		delete[] buffer[0];
-		delete[] buffer[1];
+		for(int k=0;k<nr_buffer;k++)
+			delete[] buffer[k];
+		delete[] buffer;
 		delete[] QD;
 	}
 private:
@@ -3344,7 +4988,8 @@ private:
 	schar *sign;
 	int *index;
 	mutable int next_buffer;
-	Qfloat *buffer[2];
+	int nr_buffer;
+	Qfloat **buffer;
 	double *QD;
 };
 
@@ -3463,118 +5108,529 @@ const char *svm_check_parameter(const svm_problem *prob, const svm_parameter *pa
 		if(param->p < 0)
 			return "p < 0";
 
-	if(param->shrinking != 0 &&
-	   param->shrinking != 1)
-		return "shrinking != 0 and shrinking != 1";
+	if(param->shrinking != 0 &&
+	   param->shrinking != 1)
+		return "shrinking != 0 and shrinking != 1";
+
+
+	// check whether nu-svc is feasible
+	
+	if(svm_type == NU_SVC)
+	{
+		int l = prob->l;
+		int max_nr_class = 16;
+		int nr_class = 0;
+		int *label = Malloc(int,max_nr_class);
+		int *count = Malloc(int,max_nr_class);
+
+		int i;
+		for(i=0;i<l;i++)
+		{
+			int this_label = (int)prob->y[i];
+			int j;
+			for(j=0;j<nr_class;j++)
+				if(this_label == label[j])
+				{
+					++count[j];
+					break;
+				}
+			if(j == nr_class)
+			{
+				if(nr_class == max_nr_class)
+				{
+					max_nr_class *= 2;
+					label = (int *)realloc(label,max_nr_class*sizeof(int));
+					count = (int *)realloc(count,max_nr_class*sizeof(int));
+				}
+				label[nr_class] = this_label;
+				count[nr_class] = 1;
+				++nr_class;
+			}
+		}
+	
+		for(i=0;i<nr_class;i++)
+		{
+			int n1 = count[i];
+			for(int j=i+1;j<nr_class;j++)
+			{
+				int n2 = count[j];
+				if(param->nu*(n1+n2)/2 > min(n1,n2))
+				{
+					free(label);
+					free(count);
+					return "specified nu is infeasible";
+				}
+			}
+		}
+	}
+
+	return NULL; 
+}
+
+
+//
+// Cascade SVM (Graf et al., 2005) for C_SVC, ONE_CLASS and EPSILON_SVR
+//
+// The samples are dealt round robin into nr_parts subsets that are
+// trained in parallel.  The support vectors of neighbouring subsets
+// are merged and retrained, warm-started from their alphas, until a
+// single subset is left.  Feedback passes then evaluate the gradient
+// of the whole problem, add every sample violating the KKT conditions
+// and retrain, until no violator is left.  Should that not happen
+// within CASCADE_FEEDBACK passes a global solve, warm-started from the
+// current alphas, finishes the job.
+//
+#define CASCADE_FEEDBACK 10
+
+class Cascade {
+public:
+	Cascade(const svm_problem *prob, const svm_parameter *param,
+		double Cp, double Cn, Budget *budget);
+	~Cascade();
+
+	// alpha has l entries (2*l for EPSILON_SVR) and is solved in place
+	void Solve(double *alpha, Solver::SolutionInfo *si);
+private:
+	const svm_problem *prob;
+	const svm_parameter *param;
+	int l, nvar;
+	double Cp, Cn;
+	Budget *budget;
+
+	QMatrix *make_Q(const svm_problem& sub, const svm_parameter& sp,
+			const schar *y) const;
+	void setup(const int *idx, int n, double *p, schar *y, int *var) const;
+	void solve_subset(const int *idx, int n, double *alpha,
+			  double cache_size, Solver::SolutionInfo *si) const;
+	bool is_sv(int k, const double *alpha) const
+	{
+		return alpha[k] > 0 || (nvar > l && alpha[k+l] > 0);
+	}
+	double get_C(schar y) const { return (y > 0)? Cp : Cn; }
+};
+
+Cascade::Cascade(const svm_problem *prob_, const svm_parameter *param_,
+		 double Cp_, double Cn_, Budget *budget_)
+	:prob(prob_), param(param_), Cp(Cp_), Cn(Cn_), budget(budget_)
+{
+	l = prob->l;
+	nvar = (param->svm_type == EPSILON_SVR)? 2*l : l;
+	if(param->svm_type == ONE_CLASS)
+		Cp = Cn = 1.0;
+}
+
+Cascade::~Cascade()
+{
+}
+
+QMatrix *Cascade::make_Q(const svm_problem& sub, const svm_parameter& sp,
+			 const schar *y) const
+{
+	switch(param->svm_type)
+	{
+		case C_SVC:
+			return new SVC_Q(sub,sp,y);
+		case ONE_CLASS:
+			return new ONE_CLASS_Q(sub,sp);
+		default:
+			return new SVR_Q(sub,sp);
+	}
+}
+
+// linear term, labels and global variable index of the
+// problem restricted to the samples idx[0..n)
+void Cascade::setup(const int *idx, int n, double *p, schar *y, int *var) const
+{
+	for(int k=0;k<n;k++)
+	{
+		int i = idx[k];
+		var[k] = i;
+		switch(param->svm_type)
+		{
+			case C_SVC:
+				p[k] = -1;
+				y[k] = (prob->y[i] > 0)? +1 : -1;
+				break;
+			case ONE_CLASS:
+				p[k] = 0;
+				y[k] = +1;
+				break;
+			default:
+				p[k] = param->p - prob->y[i];
+				y[k] = +1;
+				p[k+n] = param->p + prob->y[i];
+				y[k+n] = -1;
+				var[k+n] = i+l;
+		}
+	}
+}
+
+void Cascade::solve_subset(const int *idx, int n, double *alpha,
+			   double cache_size, Solver::SolutionInfo *si) const
+{
+	int nv = (nvar > l)? 2*n : n;
+	svm_problem sub;
+	sub.l = n;
+	sub.n = prob->n;
+	sub.y = new double[n];
+	sub.x = new svm_node*[n];
+	for(int k=0;k<n;k++)
+	{
+		sub.y[k] = prob->y[idx[k]];
+		sub.x[k] = prob->x[idx[k]];
+	}
+	svm_parameter sp = *param;
+	sp.cache_size = cache_size;
+
+	double *p = new double[nv];
+	schar *y = new schar[nv];
+	int *var = new int[nv];
+	double *a = new double[nv];
+	setup(idx,n,p,y,var);
+	for(int k=0;k<nv;k++)
+		a[k] = alpha[var[k]];
+
+	QMatrix *Q = make_Q(sub,sp,y);
+	Solver s(budget);
+	s.Solve(nv, *Q, p, y, a, Cp, Cn, param->eps, si,
+		param->shrinking, param->npairs);
+	delete Q;
+
+	for(int k=0;k<nv;k++)
+		alpha[var[k]] = a[k];
+
+	delete[] a;
+	delete[] var;
+	delete[] y;
+	delete[] p;
+	delete[] sub.x;
+	delete[] sub.y;
+}
+
+void Cascade::Solve(double *alpha, Solver::SolutionInfo *si)
+{
+	int i, k;
+	int nr_parts = min(param->cascade, l/2);
+	int nthreads = 1;
+#ifdef _OPENMP
+	nthreads = min(omp_get_max_threads(), nr_parts);
+#endif
+	double cache_size = max(1.0, param->cache_size/nthreads);
+
+	// first layer: round robin keeps the class mix of every subset
+	int *start = new int[nr_parts+1];
+	int *count = new int[nr_parts];
+	int *idx = new int[l];
+	int *buf = new int[l];
+	for(k=0;k<nr_parts;k++)
+		count[k] = l/nr_parts + (k < l%nr_parts);
+	start[0] = 0;
+	for(k=0;k<nr_parts;k++)
+		start[k+1] = start[k] + count[k];
+	for(i=0;i<l;i++)
+		idx[start[i%nr_parts] + i/nr_parts] = i;
 
+	for(i=0;i<nvar;i++)
+		alpha[i] = 0;
+	if(param->svm_type == ONE_CLASS)
+		for(k=0;k<nr_parts;k++)
+		{
+			int n = (int)(param->nu*count[k]);
+			for(i=0;i<n;i++)
+				alpha[idx[start[k]+i]] = 1;
+			if(n < count[k])
+				alpha[idx[start[k]+n]] = param->nu*count[k] - n;
+		}
 
-	// check whether nu-svc is feasible
-	
-	if(svm_type == NU_SVC)
+	// train, keep the support vectors, merge neighbours
+	for(int nr=nr_parts;;)
 	{
-		int l = prob->l;
-		int max_nr_class = 16;
-		int nr_class = 0;
-		int *label = Malloc(int,max_nr_class);
-		int *count = Malloc(int,max_nr_class);
+#pragma omp parallel for schedule(dynamic,1) num_threads(nthreads)
+		for(k=0;k<nr;k++)
+		{
+			Solver::SolutionInfo sk;
+			solve_subset(idx+start[k],count[k],alpha,cache_size,&sk);
+			if(nr == 1)
+				*si = sk;
+		}
+		if(nr == 1)
+			break;
 
-		int i;
-		for(i=0;i<l;i++)
+		int pos = 0;
+		for(k=0;k<nr;k++)
 		{
-			int this_label = (int)prob->y[i];
-			int j;
-			for(j=0;j<nr_class;j++)
-				if(this_label == label[j])
-				{
-					++count[j];
-					break;
-				}
-			if(j == nr_class)
+			int n = 0;
+			for(i=start[k];i<start[k+1];i++)
+				if(is_sv(idx[i],alpha))
+					buf[pos+n++] = idx[i];
+			start[k] = pos;
+			count[k] = n;
+			pos += n;
+		}
+		start[nr] = pos;
+		swap(idx,buf);
+		for(k=0;k<nr/2;k++)
+		{
+			start[k] = start[2*k];
+			count[k] = count[2*k] + count[2*k+1];
+		}
+		if(nr%2)
+		{
+			start[nr/2] = start[nr-1];
+			count[nr/2] = count[nr-1];
+		}
+		nr = (nr+1)/2;
+		start[nr] = pos;
+	}
+
+	// feedback: check the cascade solution on the whole problem
+	int n = count[0];
+	double *p = new double[nvar];
+	schar *y = new schar[nvar];
+	int *var = new int[nvar];
+	double *G = new double[nvar];
+	char *in = new char[l];
+	for(i=0;i<l;i++)
+		buf[i] = i;
+	setup(buf,l,p,y,var);
+	QMatrix *Q = make_Q(*prob,*param,y);
+
+	int pass;
+	for(pass=0;pass<CASCADE_FEEDBACK;pass++)
+	{
+		if(budget && budget->poll() != SOLVE_CONVERGED)
+			break;
+		for(i=0;i<nvar;i++)
+			G[i] = p[i];
+		for(i=0;i<nvar;i++)
+			if(alpha[i] > 0)
 			{
-				if(nr_class == max_nr_class)
-				{
-					max_nr_class *= 2;
-					label = (int *)realloc(label,max_nr_class*sizeof(int));
-					count = (int *)realloc(count,max_nr_class*sizeof(int));
-				}
-				label[nr_class] = this_label;
-				count[nr_class] = 1;
-				++nr_class;
+				const Qfloat *Q_i = Q->get_Q(i,nvar);
+				double alpha_i = alpha[i];
+#pragma omp parallel for schedule(static)
+				for(int t=0;t<nvar;t++)
+					G[t] += alpha_i*Q_i[t];
 			}
+
+		// m(alpha) and M(alpha) of the current subset
+		memset(in,0,l);
+		for(k=0;k<n;k++)
+			in[idx[k]] = 1;
+		double Gmax = -INF, Gmin = INF;
+		for(i=0;i<nvar;i++)
+		{
+			if(!in[i%l])
+				continue;
+			double C = get_C(y[i]);
+			double yG = -y[i]*G[i];
+			bool up = (y[i] > 0)? alpha[i] < C : alpha[i] > 0;
+			bool low = (y[i] > 0)? alpha[i] > 0 : alpha[i] < C;
+			if(up && yG > Gmax) Gmax = yG;
+			if(low && yG < Gmin) Gmin = yG;
 		}
-	
-		for(i=0;i<nr_class;i++)
+		double b = (Gmax > -INF && Gmin < INF)? (Gmax+Gmin)/2 :
+			(Gmax > -INF)? Gmax : Gmin;
+
+		// violators sit at alpha = 0, i.e. in I_up if y > 0, else in I_low
+		int nr_violators = 0;
+		for(i=0;i<nvar;i++)
 		{
-			int n1 = count[i];
-			for(int j=i+1;j<nr_class;j++)
+			int s = i%l;
+			if(in[s])
+				continue;
+			double yG = -y[i]*G[i];
+			if((y[i] > 0 && yG > b + param->eps/2) ||
+			   (y[i] < 0 && yG < b - param->eps/2))
 			{
-				int n2 = count[j];
-				if(param->nu*(n1+n2)/2 > min(n1,n2))
-				{
-					free(label);
-					free(count);
-					return "specified nu is infeasible";
-				}
+				in[s] = 1;
+				idx[n+nr_violators++] = s;
 			}
 		}
+		if(nr_violators == 0)
+			break;
+		n += nr_violators;
+		solve_subset(idx,n,alpha,param->cache_size,si);
+
+		// drop samples that left the support
+		int m = 0;
+		for(k=0;k<n;k++)
+			if(is_sv(idx[k],alpha))
+				idx[m++] = idx[k];
+		n = m;
+	}
+	if(pass == CASCADE_FEEDBACK)
+	{
+		Solver s(budget);
+		s.Solve(nvar, *Q, p, y, alpha, Cp, Cn, param->eps, si,
+			param->shrinking, param->npairs);
 	}
 
-	return NULL; 
+	delete Q;
+	delete[] in;
+	delete[] G;
+	delete[] var;
+	delete[] y;
+	delete[] p;
+	delete[] buf;
+	delete[] idx;
+	delete[] count;
+	delete[] start;
 }
 
 
 #include <R.h>
 #include <Rinternals.h>
 #include <Rmath.h>
+#include <R_ext/Lapack.h>
+
+static void check_interrupt(void *dummy)
+{
+	R_CheckUserInterrupt();
+}
+
+// R_CheckUserInterrupt() itself would longjmp over the solvers
+// and leak everything they allocated
+static bool user_interrupt()
+{
+	return R_ToplevelExec(check_interrupt, NULL) == FALSE;
+}
+
+// attach the termination status of a solver call to its result
+static void set_status(SEXP ans, const Budget& budget)
+{
+	SEXP status, iter;
+	PROTECT(ans);
+	PROTECT(status = ScalarInteger(budget.result()));
+	setAttrib(ans, install("status"), status);
+	PROTECT(iter = ScalarReal(budget.spent()));
+	setAttrib(ans, install("iterations"), iter);
+	UNPROTECT(3);
+}
+
+#ifdef KERNLAB_TELEMETRY
+// attach the telemetry counters and the active_size trace of a
+// solver call to its result
+static void set_telemetry(SEXP ans)
+{
+	SEXP tm, names, counts, trace, dimnames, colnames;
+	int k, n = telemetry.nr_trace;
+	static const char *trace_names[3] = { "run", "iteration", "active.size" };
+
+	PROTECT(ans);
+	PROTECT(tm = allocVector(VECSXP, 2));
+	PROTECT(names = allocVector(STRSXP, 2));
+	SET_STRING_ELT(names, 0, mkChar("counters"));
+	SET_STRING_ELT(names, 1, mkChar("trace"));
+	setAttrib(tm, R_NamesSymbol, names);
+
+	PROTECT(counts = allocVector(REALSXP, TM_NR));
+	PROTECT(names = allocVector(STRSXP, TM_NR));
+	for(k=0;k<TM_NR;k++)
+	{
+		REAL(counts)[k] = telemetry.count[k];
+		SET_STRING_ELT(names, k, mkChar(tm_names[k]));
+	}
+	setAttrib(counts, R_NamesSymbol, names);
+	SET_VECTOR_ELT(tm, 0, counts);
+
+	PROTECT(trace = allocMatrix(INTSXP, n, 3));
+	for(int i=0;i<n;i++)
+		for(k=0;k<3;k++)
+			INTEGER(trace)[k*n+i] = telemetry.trace[3*i+k];
+	PROTECT(dimnames = allocVector(VECSXP, 2));
+	PROTECT(colnames = allocVector(STRSXP, 3));
+	for(k=0;k<3;k++)
+		SET_STRING_ELT(colnames, k, mkChar(trace_names[k]));
+	SET_VECTOR_ELT(dimnames, 1, colnames);
+	setAttrib(trace, R_DimNamesSymbol, dimnames);
+	SET_VECTOR_ELT(tm, 1, trace);
+
+	setAttrib(ans, install("telemetry"), tm);
+	UNPROTECT(8);
+}
+#endif
 
 extern "C" {
 
-  struct svm_node ** sparsify (double *x, int r, int c)
+  /* Rows rows[k]-1, k < l, of the r x c matrix x, or its first l rows
+     if rows is NULL.  x is read in place in R's column-major layout.
+     All rows share one block of nodes, release them with free_sparse. */
+  struct svm_node ** sparsify (double *x, int r, int c, const int *rows, int l)
   {
     struct svm_node** sparse;
-    int         i, ii, count;
+    struct svm_node* space;
+    int         i, ii;
+    size_t      nnz = 0;
+    int        *count = (int *) calloc (l + 1, sizeof(int));
     
-    sparse = (struct svm_node **) malloc (r * sizeof(struct svm_node *));
-    for (i = 0; i < r; i++) {
-      /* determine nr. of non-zero elements */
-      for (count = ii = 0; ii < c; ii++)
-	if (x[i * c + ii] != 0) count++;
-      
-      /* allocate memory for column elements */
-      sparse[i] = (struct svm_node *) malloc ((count + 1) * sizeof(struct svm_node));
+    /* determine nr. of non-zero elements of each row */
+    for (ii = 0; ii < c; ii++) {
+      const double *col = x + (size_t) ii * r;
+      for (i = 0; i < l; i++)
+	if (col[rows ? rows[i] - 1 : i] != 0) count[i]++;
+    }
+    for (i = 0; i < l; i++)
+      nnz += count[i] + 1;
+
+    space = (struct svm_node *) malloc ((nnz + 1) * sizeof(struct svm_node));
+    sparse = (struct svm_node **) malloc ((l + 1) * sizeof(struct svm_node *));
+    for (nnz = i = 0; i < l; i++) {
+      sparse[i] = space + nnz;
+      nnz += count[i] + 1;
+      count[i] = 0;
+    }
+    sparse[l] = space;
       
-      /* set column elements */
-      for (count = ii = 0; ii < c; ii++)
-	if (x[i * c + ii] != 0) {
-	  sparse[i][count].index = ii;
-	  sparse[i][count].value = x[i * c + ii];
-	  count++;
+    /* set row elements, column by column */
+    for (ii = 0; ii < c; ii++) {
+      const double *col = x + (size_t) ii * r;
+      for (i = 0; i < l; i++) {
+	double v = col[rows ? rows[i] - 1 : i];
+	if (v != 0) {
+	  struct svm_node *node = &sparse[i][count[i]++];
+	  node->index = ii + 1; /* w[0] is the bias in Solver_B_linear */
+	  node->value = v;
 	}
-      
-      /* set termination element */
-      sparse[i][count].index = -1;
+      }
     }
+      
+    /* set termination elements */
+    for (i = 0; i < l; i++)
+      sparse[i][count[i]].index = -1;
     
+    free(count);
     return sparse;
   }
   
 
-struct svm_node ** transsparse (double *x, int r, int *rowindex, int *colindex)
+/* rows rows[k]-1, k < l, or the first l rows if rows is NULL, of the
+   CSR matrix with values x, row pointers rowindex and column indices
+   colindex, in one block as for sparsify */
+struct svm_node ** transsparse (double *x, int *rowindex, int *colindex, const int *rows, int l)
 {
     struct svm_node** sparse;
-    int i, ii, count = 0, nnz = 0;
+    struct svm_node* space;
+    int i, ii, nnz = 0;
+    size_t total = l + 1;
 
-    sparse = (struct svm_node **) malloc (r * sizeof(struct svm_node*));
-    for (i = 0; i < r; i++) {
-        /* allocate memory for column elements */
-        nnz = rowindex[i+1] - rowindex[i];
-        sparse[i] = (struct svm_node *) malloc ((nnz + 1) * sizeof(struct svm_node));
+    for (i = 0; i < l; i++) {
+        int row = rows ? rows[i] - 1 : i;
+        total += rowindex[row+1] - rowindex[row];
+    }
+    space = (struct svm_node *) malloc (total * sizeof(struct svm_node));
+    sparse = (struct svm_node **) malloc ((l + 1) * sizeof(struct svm_node*));
+    sparse[l] = space;
+    for (i = 0; i < l; i++) {
+        int row = rows ? rows[i] - 1 : i;
+        int start = rowindex[row] - rowindex[0];
+        nnz = rowindex[row+1] - rowindex[row];
+        sparse[i] = space;
+        space += nnz + 1;
 
         /* set column elements */
         for (ii = 0; ii < nnz; ii++) {
-            sparse[i][ii].index = colindex[count];
-            sparse[i][ii].value = x[count];
-            count++;
+            sparse[i][ii].index = colindex[start + ii];
+            sparse[i][ii].value = x[start + ii];
         }
 
         /* set termination element */
@@ -3585,9 +5641,52 @@ struct svm_node ** transsparse (double *x, int r, int *rowindex, int *colindex)
 
 }
 
+/* For a precomputed kernel matrix the only feature of an example is
+   its row in K, see Kernel::kernel_R, so that the rows stay with the
+   examples when a solver reorders or subsets them. */
+struct svm_node ** kernelrows (const int *rows, int l)
+{
+    struct svm_node** sparse;
+    struct svm_node* space;
+    int i;
+
+    space = (struct svm_node *) malloc ((2*l + 1) * sizeof(struct svm_node));
+    sparse = (struct svm_node **) malloc ((l + 1) * sizeof(struct svm_node*));
+    sparse[l] = space;
+    for (i = 0; i < l; i++) {
+        sparse[i] = space + 2*i;
+        sparse[i][0].index = 1;
+        sparse[i][0].value = rows ? rows[i] - 1 : i;
+        sparse[i][1].index = -1;
+    }
+    return sparse;
+}
+
+/* the training rows of smo_optim and tron_optim, see above; rows
+   selects from the r rows of x, or of K for a precomputed kernel */
+struct svm_node ** get_rows (SEXP x, int r, int c, SEXP rowindex, SEXP colindex,
+			     int sparse, int kernel_type, SEXP rows, int *l)
+{
+    const int *sel = LENGTH(rows) > 0 ? INTEGER(rows) : NULL;
+    *l = sel ? LENGTH(rows) : r;
+    if (kernel_type == R)
+      return kernelrows(sel, *l);
+    if (sparse > 0)
+      return transsparse(REAL(x), INTEGER(rowindex), INTEGER(colindex), sel, *l);
+    return sparsify(REAL(x), r, c, sel, *l);
+}
+
+/* rows from sparsify or transsparse, sparse[r] is their block */
+void free_sparse (struct svm_node **sparse, int r)
+{
+    free(sparse[r]);
+    free(sparse);
+}
+
 
   void tron_run(const svm_problem *prob, const svm_parameter* param, 
-		  double *alpha,  double *weighted_C, Solver_B::SolutionInfo* sii, int nr_class, int *count)
+		  double *alpha,  double *weighted_C, Solver_B::SolutionInfo* sii, int nr_class, int *count,
+		  Budget *budget)
   {
     int l = prob->l;
     int i;
@@ -3617,12 +5716,39 @@ struct svm_node ** transsparse (double *x, int r, int *rowindex, int *colindex)
 		if(prob->y[i] > 0) y[i] = +1; else y[i]=-1;
 	}
 
-	if (param->kernel_type == LINEAR)
+	if (param->kernel_type == LINEAR && param->linear_solver == LINEAR_DCD)
+	{
+		double *w = new double[prob->n+1];
+		for (i=0;i<=prob->n;i++)
+			w[i] = 0;
+		Solver_DCD s(budget);
+		s.Solve(l, prob->x, minus_ones, y, alpha, w, Cp, Cn,
+			param->eps, sii, param->shrinking);
+		delete[] w;
+	}
+	else if (param->kernel_type == LINEAR && param->linear_solver == LINEAR_PRIMAL)
+	{
+		double *yy = new double[l];
+		double *C = new double[l];
+		for (i=0;i<l;i++)
+		{
+			yy[i] = y[i];
+			C[i] = y[i] > 0 ? Cp : Cn;
+		}
+		Solver_Primal s(budget);
+		s.Solve(l, prob->n, prob->x, yy, C, 0, false, alpha,
+			param->eps, sii);
+		for (i=0;i<l;i++)
+			alpha[i] *= y[i];
+		delete[] yy;
+		delete[] C;
+	}
+	else if (param->kernel_type == LINEAR)
 	{
 		double *w = new double[prob->n+1];
 		for (i=0;i<=prob->n;i++)
 			w[i] = 0;
-		Solver_B_linear s;
+		Solver_B_linear s(budget);
 		int totaliter = 0;
 		double Cpj = param->Cbegin, Cnj = param->Cbegin*Cn/Cp;
 
@@ -3668,7 +5794,7 @@ struct svm_node ** transsparse (double *x, int r, int *rowindex, int *colindex)
 	}
 	else
 	  {    
-		Solver_B s;
+		Solver_B s(budget);
 		s.Solve(l, BSVC_Q(*prob,*param,y), minus_ones, y, alpha, Cp, Cn, 
 		param->eps, sii, param->shrinking, param->qpsize);
 	}
@@ -3703,7 +5829,36 @@ struct svm_node ** transsparse (double *x, int r, int *rowindex, int *colindex)
 		y[i+l] = -1;
 	}
 
-	if (param->kernel_type == LINEAR)
+	if (param->kernel_type == LINEAR && param->linear_solver == LINEAR_DCD)
+	{
+		double *w = new double[prob->n+1];
+		for (i=0;i<=prob->n;i++)
+			w[i] = 0;
+		struct svm_node **x = new svm_node*[2*l];
+		for (i=0;i<l;i++)
+			x[i] = x[i+l] = prob->x[i];
+		Solver_DCD s(budget);
+		s.Solve(2*l, x, linear_term, y, alpha2, w, param->C, param->C,
+			param->eps, sii, param->shrinking);
+		delete[] x;
+		delete[] w;
+	}
+	else if (param->kernel_type == LINEAR && param->linear_solver == LINEAR_PRIMAL)
+	{
+		double *C = new double[l];
+		for (i=0;i<l;i++)
+			C[i] = param->C;
+		Solver_Primal s(budget);
+		s.Solve(l, prob->n, prob->x, prob->y, C, param->p, true, alpha,
+			param->eps, sii);
+		for (i=0;i<l;i++)
+		{
+			alpha2[i] = max(alpha[i], 0.0);
+			alpha2[i+l] = max(-alpha[i], 0.0);
+		}
+		delete[] C;
+	}
+	else if (param->kernel_type == LINEAR)
 	{
 		double *w = new double[prob->n+1];
 		for (i=0;i<=prob->n;i++)
@@ -3711,12 +5866,12 @@ struct svm_node ** transsparse (double *x, int r, int *rowindex, int *colindex)
 		struct svm_node **x = new svm_node*[2*l];
 		for (i=0;i<l;i++)
 			x[i] = x[i+l] = prob->x[i];
-		Solver_B_linear s;
+		Solver_B_linear s(budget);
 		int totaliter = 0;
 		double Cj = param->Cbegin;
 		while (Cj < param->C)
 		{
-			totaliter += s.Solve(2*l, x, linear_term, y, alpha, w, 
+			totaliter += s.Solve(2*l, x, linear_term, y, alpha2, w, 
 			Cj, Cj, param->eps, sii, param->shrinking, param->qpsize);
 			if (Cj*param->Cstep >= param->C)
 			{
@@ -3724,11 +5879,11 @@ struct svm_node ** transsparse (double *x, int r, int *rowindex, int *colindex)
 					w[i] = 0;
 				for (i=0;i<2*l;i++)
 				{
-					if (alpha[i] >= Cj)
-						alpha[i] = param->C;
+					if (alpha2[i] >= Cj)
+						alpha2[i] = param->C;
 					else 
-						alpha[i] *= param->C/Cj;
-					double yalpha = y[i]*alpha[i];
+						alpha2[i] *= param->C/Cj;
+					double yalpha = y[i]*alpha2[i];
 					for (const svm_node *px = x[i];px->index != -1;px++)
 						w[px->index] += yalpha*px->value;
 					w[0] += yalpha;
@@ -3737,7 +5892,7 @@ struct svm_node ** transsparse (double *x, int r, int *rowindex, int *colindex)
 			else
 			{
 				for (i=0;i<2*l;i++)
-					alpha[i] *= param->Cstep;
+					alpha2[i] *= param->Cstep;
 				for (i=0;i<=prob->n;i++)
 					w[i] *= param->Cstep;
 			}
@@ -3747,10 +5902,12 @@ struct svm_node ** transsparse (double *x, int r, int *rowindex, int *colindex)
 			param->C, param->eps, sii, param->shrinking, param->qpsize);
 		//info("\noptimization finished, #iter = %d\n",totaliter);
 
+		delete[] x;
+		delete[] w;
 	}
 		else
 	{
-		Solver_B s;
+		Solver_B s(budget);
 		s.Solve(2*l, BSVR_Q(*prob,*param), linear_term, y, alpha2, param->C,
 			param->C, param->eps, sii, param->shrinking, param->qpsize);
 	}
@@ -3790,9 +5947,10 @@ struct svm_node ** transsparse (double *x, int r, int *rowindex, int *colindex)
 		  q += count[j];
 	    }
 	  
-	  	  Solver_MB s;
+	  	  Solver_MB s(budget);
 	   s.Solve(ll, BONE_CLASS_Q(*prob,*param), -2, alpha2, y, weighted_C,
 	  	  2*param->eps, &si, param->shrinking, param->qpsize, nr_class, count);
+	   sii->obj = si.obj;
 	  
 	   //info("obj = %f, rho = %f\n",si.obj,0.0);
 	   
@@ -3838,9 +5996,9 @@ struct svm_node ** transsparse (double *x, int r, int *rowindex, int *colindex)
 	      y[i] = (short) prob->y[i];	
 	    }
 
-	  Solver_SPOC s;
-	  s.Solve(l, ONE_CLASS_Q(*prob, *param), alpha, y, weighted_C,
-		  param->eps, param->shrinking, nr_class);
+	  Solver_SPOC s(budget);
+	  sii->obj = s.Solve(l, ONE_CLASS_Q(*prob, *param), alpha, y, weighted_C,
+			     param->eps, param->shrinking, nr_class, param->qpsize);
 	  free(weighted_C);
 	  delete[] y;
 	}
@@ -3854,8 +6012,8 @@ struct svm_node ** transsparse (double *x, int r, int *rowindex, int *colindex)
 		  SEXP c, 
 		  SEXP y,
 		  SEXP K,
-		  SEXP colindex,
 		  SEXP rowindex,
+		  SEXP colindex,
 		  SEXP sparse,
 		  SEXP nclass,
 		  SEXP countc,
@@ -3875,7 +6033,11 @@ struct svm_node ** transsparse (double *x, int r, int *rowindex, int *colindex)
 		  SEXP cache,
 		  SEXP epsilon, 
 		  SEXP qpsize,
-		  SEXP shrinking
+		  SEXP shrinking,
+		  SEXP maxiter,
+		  SEXP maxtime,
+		  SEXP linear_solver,
+		  SEXP rows
 		 )
   {
 
@@ -3898,7 +6060,11 @@ struct svm_node ** transsparse (double *x, int r, int *rowindex, int *colindex)
     param.Cbegin      = *REAL(Cbegin);
     param.Cstep       = *REAL(Cstep);
     param.K           =  REAL(K);
+    param.m           =  *INTEGER(r);
     param.qpsize      = *INTEGER(qpsize);
+    param.npairs      = 1;
+    param.cascade     = 0;
+    param.linear_solver = *INTEGER(linear_solver);
     nr_class          = *INTEGER(nclass);
     param.nr_weight   = *INTEGER(nweights);
     if (param.nr_weight > 0) {
@@ -3912,16 +6078,12 @@ struct svm_node ** transsparse (double *x, int r, int *rowindex, int *colindex)
     param.lim = 1/(gammafn(param.degree+1)*powi(2,param.degree));    
    
     /* set problem */
-    prob.l = *INTEGER(r);
+    prob.x = get_rows(x, *INTEGER(r), *INTEGER(c), rowindex, colindex,
+		      *INTEGER(sparse), param.kernel_type, rows, &prob.l);
     prob.n = *INTEGER(c);
     prob.y =  (double *) malloc (sizeof(double) * prob.l);
     memcpy(prob.y, REAL(y), prob.l*sizeof(double));
 
-    if (*INTEGER(sparse) > 0)
-      prob.x = transsparse(REAL(x), *INTEGER(r), INTEGER(rowindex), INTEGER(colindex));
-    else
-      prob.x = sparsify(REAL(x), *INTEGER(r), *INTEGER(c)); 
-
     s = svm_check_parameterb(&prob, &param);
     //if (s) 
       //printf("%s",s);
@@ -3944,7 +6106,9 @@ struct svm_node ** transsparse (double *x, int r, int *rowindex, int *colindex)
 	  alpha2 = (double *) malloc (sizeof(double) * prob.l);
 	}
 
-      tron_run(&prob, &param, alpha2, weighted_C , &si, nr_class, count); 
+      Budget budget(*REAL(maxiter), *REAL(maxtime));
+      TM_RESET();
+      tron_run(&prob, &param, alpha2, weighted_C , &si, nr_class, count, &budget); 
     //}
     
     /* clean up memory */
@@ -3957,8 +6121,6 @@ struct svm_node ** transsparse (double *x, int r, int *rowindex, int *colindex)
       {  
 	PROTECT(alpha3 = allocVector(REALSXP, (nr_class*prob.l + 1)));
 	UNPROTECT(1);  
-	for (i = 0; i < prob.l; i++) 
-	  free (prob.x[i]); 
 	for (i = 0; i <nr_class*prob.l; i++) 
 	  REAL(alpha3)[i] = *(alpha2+i); 
       }
@@ -3968,8 +6130,6 @@ struct svm_node ** transsparse (double *x, int r, int *rowindex, int *colindex)
 	 PROTECT(alpha3 = allocVector(REALSXP, ((nr_class-1)*prob.l + 1)));
 	 UNPROTECT(1);   
 	 free(count);
-	 for (i = 0; i < prob.l; i++) 
-	   free (prob.x[i]); 
 	 for (i = 0; i <(nr_class-1)*prob.l; i++) 
 	   REAL(alpha3)[i] = *(alpha2+i); 
        }
@@ -3977,30 +6137,58 @@ struct svm_node ** transsparse (double *x, int r, int *rowindex, int *colindex)
        {
 	PROTECT(alpha3 = allocVector(REALSXP, (prob.l + 1)));
 	UNPROTECT(1);  
-	for (i = 0; i < prob.l; i++) 
-	  free (prob.x[i]); 
 	for (i = 0; i <prob.l; i++) 
 	  REAL(alpha3)[i] = *(alpha2+i); 
       } 
-    REAL(alpha3)[prob.l] = si.obj;
+    /* the objective follows the coefficients of all types */
+    REAL(alpha3)[LENGTH(alpha3)-1] = si.obj;
     if(param.svm_type != 8 && param.svm_type != 7)
        delete[] si.upper_bound;
-    free(prob.x);
+    free_sparse(prob.x, prob.l);
     free(prob.y);
     if(param.svm_type != 7)
      free(weighted_C);
     free(alpha2);
+    set_status(alpha3, budget);
+    TM_ATTACH(alpha3);
     return alpha3;
   }
 
 
 
   void solve_smo(const svm_problem *prob, const svm_parameter* param,
-		 double *alpha, Solver::SolutionInfo* si, double C, double *linear_term)
+		 double *alpha, Solver::SolutionInfo* si, double C, double *linear_term,
+		 Budget *budget)
   {
     int l = prob->l;
     int i;
 
+    if(param->cascade > 1 && l >= 4 &&
+       (param->svm_type == C_SVC || param->svm_type == ONE_CLASS ||
+	param->svm_type == EPSILON_SVR))
+      {
+	double Cp = C, Cn = C;
+	if(param->svm_type == C_SVC && param->nr_weight > 0)
+	  {
+	    Cp = C*param->weight[0];
+	    Cn = C*param->weight[1];
+	  }
+	if(param->svm_type == EPSILON_SVR)
+	  Cp = Cn = param->C;
+	double *alpha2 = alpha;
+	if(param->svm_type == EPSILON_SVR)
+	  alpha2 = new double[2*l];
+	Cascade c(prob, param, Cp, Cn, budget);
+	c.Solve(alpha2, si);
+	if(alpha2 != alpha)
+	  {
+	    for(i=0;i<l;i++)
+	      alpha[i] = alpha2[i] - alpha2[i+l];
+	    delete[] alpha2;
+	  }
+	return;
+      }
+
     switch(param->svm_type)
       {
       case C_SVC:
@@ -4020,9 +6208,9 @@ struct svm_node ** transsparse (double *x, int r, int *rowindex, int *colindex)
 	    }
 	  else 
 	    Cp = Cn = C;
-	  Solver s; //have to weight cost parameter for multiclass. problems 
+	  Solver s(budget); //have to weight cost parameter for multiclass. problems 
 	  s.Solve(l, SVC_Q(*prob,*param,y), minus_ones, y,
-		  alpha, Cp, Cn, param->eps, si, param->shrinking);
+		  alpha, Cp, Cn, param->eps, si, param->shrinking, param->npairs);
 	  delete[] minus_ones;
 	  delete[] y;
 	}
@@ -4048,7 +6236,7 @@ struct svm_node ** transsparse (double *x, int r, int *rowindex, int *colindex)
 	  double *zeros = new double[l];
 	  for(i=0;i<l;i++)
 	    zeros[i] = 0;
-	  Solver_NU s;
+	  Solver_NU s(budget);
 	  s.Solve(l, SVC_Q(*prob,*param,y), zeros, y,
 		  alpha, 1.0, 1.0, param->eps, si,  param->shrinking);
 	  double r = si->r;
@@ -4081,9 +6269,9 @@ struct svm_node ** transsparse (double *x, int r, int *rowindex, int *colindex)
 	      ones[i] = 1;
 	    }
 	  
-	  Solver s;
+	  Solver s(budget);
 	  s.Solve(l, ONE_CLASS_Q(*prob,*param), zeros, ones,
-		  alpha, 1.0, 1.0, param->eps, si, param->shrinking);
+		  alpha, 1.0, 1.0, param->eps, si, param->shrinking, param->npairs);
 
 	  delete[] zeros;
 	  delete[] ones;
@@ -4104,9 +6292,10 @@ struct svm_node ** transsparse (double *x, int r, int *rowindex, int *colindex)
 	      linear_term[i+l] = param->p + prob->y[i];
 	      y[i+l] = -1;
 	    }
-	  Solver s;
+	  Solver s(budget);
 	  s.Solve(2*l, SVR_Q(*prob,*param), linear_term, y,
-		  alpha2, param->C, param->C, param->eps, si, param->shrinking);
+		  alpha2, param->C, param->C, param->eps, si, param->shrinking,
+		  param->npairs);
 	  double sum_alpha = 0;
 	  for(i=0;i<l;i++)
 	    {
@@ -4139,7 +6328,7 @@ struct svm_node ** transsparse (double *x, int r, int *rowindex, int *colindex)
 			y[i+l] = -1;
 		      }
 		    
-		    Solver_NU s;
+		    Solver_NU s(budget);
 		    s.Solve(2*l, SVR_Q(*prob,*param), linear_term, y,
 			    alpha2, C, C, param->eps, si, param->shrinking);
 		    
@@ -4156,6 +6345,400 @@ struct svm_node ** transsparse (double *x, int r, int *rowindex, int *colindex)
       }
   }
 
+  /* Cross validation decision values for the probability models of
+     C_SVC and NU_SVC.  Binary problem p consists of the rows
+     rows[start[p]], ..., rows[start[p+1]-1] of x, or of K for a
+     precomputed kernel, with labels y and folds fold in 1..nfold.
+     Every fold is predicted by the model trained on the other folds
+     of its problem; all problems and folds are solved in parallel,
+     each with an equal share of the cache.  weights holds the cost
+     weights of the positive and the negative class of every problem,
+     or is empty.  maxiter and maxtime bound all runs together as in
+     smo_optim, and the master thread checks for user interrupts; the
+     runs left when they stop the training give decision values 0. */
+  SEXP svm_cv_decision(SEXP x,
+		       SEXP r,
+		       SEXP c,
+		       SEXP K,
+		       SEXP rows,
+		       SEXP start,
+		       SEXP y,
+		       SEXP fold,
+		       SEXP nfold,
+		       SEXP kernel_type,
+		       SEXP svm_type,
+		       SEXP cost,
+		       SEXP nu,
+		       SEXP gamma,
+		       SEXP degree,
+		       SEXP coef0,
+		       SEXP weights,
+		       SEXP cache,
+		       SEXP epsilon,
+		       SEXP shrinking,
+		       SEXP maxiter,
+		       SEXP maxtime
+		       )
+  {
+    struct svm_parameter param;
+    SEXP ans;
+    int np = LENGTH(start) - 1, nf = *INTEGER(nfold), ntask = np * nf;
+    int nr = *INTEGER(r), nc = *INTEGER(c);
+    const int *row = INTEGER(rows), *first = INTEGER(start), *fo = INTEGER(fold);
+    const double *yy = REAL(y), *w = REAL(weights);
+    double *xx = REAL(x);
+    const bool weighted = LENGTH(weights) > 0;
+    int nthreads = 1;
+
+    memset(&param, 0, sizeof(param));
+    param.svm_type    = *INTEGER(svm_type);
+    param.kernel_type = *INTEGER(kernel_type);
+    param.degree      = *INTEGER(degree);
+    param.gamma       = *REAL(gamma);
+    param.coef0       = *REAL(coef0);
+    param.eps         = *REAL(epsilon);
+    param.C           = *REAL(cost);
+    param.nu          = *REAL(nu);
+    param.K           = REAL(K);
+    param.m           = nr;
+    param.npairs      = 1;
+    param.linear_solver = LINEAR_TRON;
+    param.qpsize      = 2;
+    param.shrinking   = *INTEGER(shrinking);
+    param.lim = 1/(gammafn(param.degree+1)*powi(2,param.degree));
+#ifdef _OPENMP
+    nthreads = max(1, min(omp_get_max_threads(), ntask));
+#endif
+    param.cache_size  = max(1.0, *REAL(cache)/nthreads);
+
+    PROTECT(ans = allocVector(REALSXP, LENGTH(rows)));
+    double *dec = REAL(ans);
+    Budget budget(*REAL(maxiter), *REAL(maxtime));
+    budget.poll_on_master();
+
+#pragma omp parallel for schedule(dynamic) num_threads(nthreads)
+    for (int t = 0; t < ntask; t++) {
+      int p = t / nf, k = t % nf + 1;
+      /* once the budget is spent or the master saw an interrupt the
+	 remaining tasks only clear their decision values */
+      bool run = budget.poll() == SOLVE_CONVERGED;
+      int n = first[p+1] - first[p], l = 0, nt = 0, i, j;
+      /* the training rows followed by the rows of fold k */
+      int *sel = new int[n], *test = new int[n];
+      double *ty = new double[n];
+      for (i = first[p]; i < first[p+1]; i++)
+	if (fo[i] != k) {
+	  sel[l] = row[i];
+	  ty[l++] = yy[i];
+	}
+	else
+	  test[nt++] = i;
+      for (j = 0; j < nt; j++)
+	sel[l+j] = row[test[j]];
+
+      if (run && nt > 0 && l > 0) {
+	struct svm_parameter pp = param;
+	struct svm_problem prob;
+	struct Solver::SolutionInfo si;
+	int wl[2] = {0, 1};
+	double wt[2];
+	if (weighted) {
+	  wt[0] = w[2*p];
+	  wt[1] = w[2*p+1];
+	  pp.nr_weight = 2;
+	  pp.weight = wt;
+	  pp.weight_label = wl;
+	}
+	prob.l = l;
+	prob.n = nc;
+	prob.y = ty;
+	prob.x = pp.kernel_type == R ? kernelrows(sel, l + nt)
+				      : sparsify(xx, nr, nc, sel, l + nt);
+	double *alpha = new double[l];
+	solve_smo(&prob, &pp, alpha, &si, pp.C, NULL, &budget);
+	/* C_SVC returns alpha, NU_SVC alpha*y */
+	if (pp.svm_type == C_SVC)
+	  for (i = 0; i < l; i++)
+	    alpha[i] *= ty[i] > 0 ? 1 : -1;
+
+	Kernel_eval kernel(l + nt, prob.x, pp);
+	for (j = 0; j < nt; j++) {
+	  double d = -si.rho;
+	  for (i = 0; i < l; i++)
+	    if (alpha[i] != 0)
+	      d += alpha[i] * kernel(i, l + j);
+	  dec[test[j]] = d;
+	}
+	delete[] alpha;
+	free_sparse(prob.x, l + nt);
+      }
+      else
+	for (j = 0; j < nt; j++)
+	  dec[test[j]] = 0;
+      delete[] sel;
+      delete[] test;
+      delete[] ty;
+    }
+
+    set_status(ans, budget);
+    UNPROTECT(1);
+    return ans;
+  }
+
+  /* Platt's sigmoid 1/(1+exp(A*dec+B)) fitted to the labels y >= 0 by
+     Newton's method with backtracking, see Lin, Lin and Weng, A note
+     on Platt's probabilistic outputs for support vector machines.
+     Returns A, B and 0, or 1 if the line search failed, or 2 if the
+     iterations ran out. */
+  SEXP svm_platt(SEXP deci, SEXP y)
+  {
+    const int l = LENGTH(deci), maxiter = 100;
+    const double *dec = REAL(deci), *yy = REAL(y);
+    const double minstep = 1e-10, sigma = 1e-3, eps = 1e-5;
+    double prior1 = 0, prior0, A, B, fval = 0;
+    int i, it, status = 2;
+    SEXP ans;
+
+    for (i = 0; i < l; i++)
+      if (yy[i] >= 0)
+	prior1++;
+    prior0 = l - prior1;
+    const double hiTarget = (prior1 + 1)/(prior1 + 2);
+    const double loTarget = 1/(prior0 + 2);
+    double *t = new double[l];
+    for (i = 0; i < l; i++)
+      t[i] = yy[i] >= 0 ? hiTarget : loTarget;
+
+    A = 0;
+    B = log((prior0 + 1)/(prior1 + 1));
+    for (i = 0; i < l; i++) {
+      double fApB = dec[i]*A + B;
+      if (fApB >= 0)
+	fval += t[i]*fApB + log(1 + exp(-fApB));
+      else
+	fval += (t[i] - 1)*fApB + log(1 + exp(fApB));
+    }
+
+    for (it = 0; it < maxiter; it++) {
+      double h11 = sigma, h22 = sigma, h21 = 0, g1 = 0, g2 = 0;
+      for (i = 0; i < l; i++) {
+	double fApB = dec[i]*A + B, p, q;
+	if (fApB >= 0) {
+	  p = exp(-fApB)/(1 + exp(-fApB));
+	  q = 1/(1 + exp(-fApB));
+	}
+	else {
+	  p = 1/(1 + exp(fApB));
+	  q = exp(fApB)/(1 + exp(fApB));
+	}
+	double d2 = p*q, d1 = t[i] - p;
+	h11 += dec[i]*dec[i]*d2;
+	h22 += d2;
+	h21 += dec[i]*d2;
+	g1 += dec[i]*d1;
+	g2 += d1;
+      }
+      if (fabs(g1) < eps && fabs(g2) < eps) {
+	status = 0;
+	break;
+      }
+
+      /* Newton direction -inv(H) g and backtracking line search */
+      double det = h11*h22 - h21*h21;
+      double dA = -(h22*g1 - h21*g2)/det;
+      double dB = -(-h21*g1 + h11*g2)/det;
+      double gd = g1*dA + g2*dB, stepsize = 1;
+      while (stepsize >= minstep) {
+	double newA = A + stepsize*dA, newB = B + stepsize*dB, newf = 0;
+	for (i = 0; i < l; i++) {
+	  double fApB = dec[i]*newA + newB;
+	  if (fApB >= 0)
+	    newf += t[i]*fApB + log(1 + exp(-fApB));
+	  else
+	    newf += (t[i] - 1)*fApB + log(1 + exp(fApB));
+	}
+	if (newf < fval + 0.0001*stepsize*gd) {
+	  A = newA;
+	  B = newB;
+	  fval = newf;
+	  break;
+	}
+	stepsize /= 2;
+      }
+      if (stepsize < minstep) {
+	status = 1;
+	break;
+      }
+    }
+    delete[] t;
+
+    PROTECT(ans = allocVector(REALSXP, 3));
+    REAL(ans)[0] = A;
+    REAL(ans)[1] = B;
+    REAL(ans)[2] = status;
+    UNPROTECT(1);
+    return ans;
+  }
+
+  /* The pairwise probabilities of one row as the k x k matrix of
+     couplers.R: the upper triangle filled column by column with probin
+     and the lower one with 1 - probin. */
+  static void pair_matrix(const double *probin, int m, int k, double *probim)
+  {
+    int i, j, q;
+
+    memset(probim, 0, sizeof(double) * k * k);
+    for (q = 0, j = 0; j < k; j++)
+      for (i = 0; i < j; i++)
+	probim[i + j*k] = probin[(size_t) m * q++];
+    for (q = 0, j = 0; j < k; j++)
+      for (i = j + 1; i < k; i++)
+	probim[i + j*k] = 1 - probin[(size_t) m * q++];
+  }
+
+  /* minpair: the solution of the k+1 equations of the quadratic
+     problem, solved as solve() does.  Returns 0, or the dgesv info, or
+     -1 with rcond if the system is computationally singular. */
+  static int couple_minpair(const double *probin, int m, int k, double *p,
+			    double *rcond, double *work, int *iwork)
+  {
+    const int n = k + 1, one = 1;
+    double *probim = work, *SQ = work + k*k, *lwork = SQ + n*n;
+    int i, j, q, info;
+
+    pair_matrix(probin, m, k, probim);
+    memset(SQ, 0, sizeof(double) * n * n);
+    for (j = 0; j < k; j++) {
+      long double sum = 0;
+      for (i = 0; i < k; i++)
+	sum += probim[i + j*k] * probim[i + j*k];
+      SQ[j + j*n] = (double) sum;
+    }
+    for (q = 0, j = 0; j < k; j++)
+      for (i = 0; i < j; i++, q++)
+	SQ[i + j*n] = -probin[(size_t) m * q] * (1 - probin[(size_t) m * q]);
+    for (q = 0, j = 0; j < k; j++)
+      for (i = j + 1; i < k; i++, q++)
+	SQ[i + j*n] = -probin[(size_t) m * q] * (1 - probin[(size_t) m * q]);
+    for (i = 0; i < k; i++)
+      SQ[k + i*n] = SQ[i + k*n] = 1;
+    for (i = 0; i < k; i++)
+      p[i] = 0;
+    p[k] = 1;
+
+    double anorm = F77_CALL(dlange)("1", &n, &n, SQ, &n, NULL);
+    F77_CALL(dgesv)(&n, &one, SQ, &n, iwork, p, &n, &info);
+    if (info > 0)
+      return info;
+    F77_CALL(dgecon)("1", &n, SQ, &n, &anorm, rcond, lwork, iwork, &info);
+    if (*rcond < DBL_EPSILON)
+      return -1;
+
+    long double sum = 0;
+    for (i = 0; i < k; i++)
+      sum += p[i];
+    for (i = 0; i < k; i++)
+      p[i] /= (double) sum;
+    return 0;
+  }
+
+  static void couple_pkpd(const double *probin, int m, int k, double *p, double *probim)
+  {
+    int i, j;
+
+    pair_matrix(probin, m, k, probim);
+    for (i = 0; i < k; i++) {
+      long double sum = 0;
+      for (j = 0; j < k; j++)
+	if (j != i)
+	  sum += 1/(probim[i + j*k] == 0 ? 1e-300 : probim[i + j*k]);
+      p[i] = 1/((double) sum - (k-2));
+    }
+    long double sum = 0;
+    for (i = 0; i < k; i++)
+      sum += p[i];
+    for (i = 0; i < k; i++)
+      p[i] /= (double) sum;
+  }
+
+  /* vote as in couplers.R, which counts probin[i] for class i and
+     probin[j] for class j of every pair i < j */
+  static void couple_vote(const double *probin, int m, int k, double *p)
+  {
+    const int npair = k*(k-1)/2;
+    int i, j;
+
+    for (i = 0; i < k; i++)
+      p[i] = 0;
+    for (i = 0; i < k - 1; i++)
+      for (j = i + 1; j < k; j++) {
+	if (i < npair && probin[(size_t) m * i] >= 0.5)
+	  p[i]++;
+	if (j < npair && probin[(size_t) m * j] < 0.5)
+	  p[j]++;
+      }
+    long double sum = 0;
+    for (i = 0; i < k; i++)
+      sum += p[i];
+    for (i = 0; i < k; i++)
+      p[i] /= (double) sum;
+  }
+
+  /* The couplers minpair (0), pkpd (1) and vote (2) of couplers.R
+     applied to every row of the m x k(k-1)/2 matrix probin of
+     pairwise probabilities, with the same arithmetic as the R code so
+     that the m x k results are identical.  The rows are coupled in
+     parallel. */
+  SEXP couple_probabilities(SEXP probin, SEXP nclass, SEXP coupler)
+  {
+    const int m = nrows(probin), k = *INTEGER(nclass), type = *INTEGER(coupler);
+    const double *pin = REAL(probin);
+    SEXP ans;
+    int *status = new int[m];
+    double *rconds = new double[m];
+
+    PROTECT(ans = allocMatrix(REALSXP, m, k));
+    double *out = REAL(ans);
+
+#pragma omp parallel
+    {
+      double *p = new double[k + 1];
+      double *work = new double[k*k + (k+1)*(k+1) + 4*(k+1)];
+      int *iwork = new int[k + 1];
+#pragma omp for schedule(static)
+      for (int r = 0; r < m; r++) {
+	status[r] = 0;
+	if (type == 0)
+	  status[r] = couple_minpair(pin + r, m, k, p, &rconds[r], work, iwork);
+	else if (type == 1)
+	  couple_pkpd(pin + r, m, k, p, work);
+	else
+	  couple_vote(pin + r, m, k, p);
+	for (int i = 0; i < k; i++)
+	  out[r + (size_t) m * i] = p[i];
+      }
+      delete[] p;
+      delete[] work;
+      delete[] iwork;
+    }
+
+    /* the error solve() raises for the first row that fails */
+    for (int r = 0; r < m; r++)
+      if (status[r] != 0) {
+	int info = status[r];
+	double rcond = rconds[r];
+	delete[] status;
+	delete[] rconds;
+	if (info > 0)
+	  error("Lapack routine %s: system is exactly singular: U[%d,%d] = 0", "dgesv", info, info);
+	error("system is computationally singular: reciprocal condition number = %g", rcond);
+      }
+    delete[] status;
+    delete[] rconds;
+    UNPROTECT(1);
+    return ans;
+  }
+
   SEXP smo_optim(SEXP x,
 		 SEXP r, 
 		 SEXP c, 
@@ -4178,7 +6761,12 @@ struct svm_node ** transsparse (double *x, int r, int *rowindex, int *colindex)
 		 SEXP nweights, 
 		 SEXP cache,
 		 SEXP epsilon, 
-		 SEXP shrinking
+		 SEXP shrinking,
+		 SEXP pairs,
+		 SEXP cascade,
+		 SEXP maxiter,
+		 SEXP maxtime,
+		 SEXP rows
 		 )
   {
     
@@ -4201,7 +6789,10 @@ struct svm_node ** transsparse (double *x, int r, int *rowindex, int *colindex)
     param.m           =  *INTEGER(r);
     param.Cbegin      = 0; // for bsvm
     param.Cstep       = 0; // for bsvm
-    param.qpsize      = 2; // mainly for bsvm but set to 2  
+    param.npairs      = *INTEGER(pairs);
+    param.cascade     = *INTEGER(cascade);
+    param.linear_solver = LINEAR_TRON;
+    param.qpsize      = max(2, 2*param.npairs); // mainly for bsvm, cache must hold the pairs
     param.nr_weight   = *INTEGER(nweights);
     if (param.nr_weight > 0) {
       param.weight      = (double *) malloc (sizeof(double) * param.nr_weight);
@@ -4214,15 +6805,11 @@ struct svm_node ** transsparse (double *x, int r, int *rowindex, int *colindex)
     param.lim = 1/(gammafn(param.degree+1)*powi(2,param.degree));    
     
     /* set problem */
-    prob.l = *INTEGER(r);
+    prob.x = get_rows(x, *INTEGER(r), *INTEGER(c), rowindex, colindex,
+		      *INTEGER(sparse), param.kernel_type, rows, &prob.l);
     prob.y = REAL(y);
     prob.n = *INTEGER(c);
 
-    if (*INTEGER(sparse) > 0)
-      prob.x = transsparse(REAL(x), *INTEGER(r), INTEGER(rowindex), INTEGER(colindex));
-    else
-      prob.x = sparsify(REAL(x), *INTEGER(r), *INTEGER(c)); 
-
     double *alpha2 = (double *) malloc (sizeof(double) * prob.l);
 
     s = svm_check_parameter(&prob, &param);
@@ -4231,7 +6818,9 @@ struct svm_node ** transsparse (double *x, int r, int *rowindex, int *colindex)
       //printf("%s",s);
     //} 
     //else {
-      solve_smo(&prob, &param, alpha2, &si, *REAL(cost), REAL(linear_term));
+      Budget budget(*REAL(maxiter), *REAL(maxtime));
+      TM_RESET();
+      solve_smo(&prob, &param, alpha2, &si, *REAL(cost), REAL(linear_term), &budget);
     //}
     
     PROTECT(alpha = allocVector(REALSXP, prob.l+2));
@@ -4241,13 +6830,291 @@ struct svm_node ** transsparse (double *x, int r, int *rowindex, int *colindex)
       free(param.weight);
       free(param.weight_label);
     }
-    for (i = 0; i < prob.l; i++) {free (prob.x[i]); REAL(alpha)[i] = *(alpha2+i); } 
-    free (prob.x);
+    for (i = 0; i < prob.l; i++) REAL(alpha)[i] = *(alpha2+i);
+    free_sparse(prob.x, prob.l);
     REAL(alpha)[prob.l] = si.rho;
     REAL(alpha)[prob.l+1] = si.obj;
     free(alpha2); 
+    set_status(alpha, budget);
+    TM_ATTACH(alpha);
     UNPROTECT(1);  
     
     return alpha;
   }
+
+  /* model on the support vectors, coefficients and kernel of
+     svm_predict and svm_write_model, with its explicit form: given,
+     the weights of svm_weights, if they fit the model, or else
+     computed if weights and the kernel has one; the rows of sv are
+     freed with free_sparse(*rows, nsv), delete[] *rowptr and
+     delete[] *w */
+  static void r_model (struct svm_model *model, struct svm_node ***rows, int64_t **rowptr,
+		       double **w, bool weights, SEXP given,
+		       SEXP sv, SEXP nsv, SEXP c, SEXP svindex, SEXP start, SEXP coef,
+		       SEXP b, SEXP nclass, SEXP center, SEXP scale, SEXP kernel_type,
+		       SEXP sigma, SEXP degree, SEXP offset)
+  {
+    int i, u = *INTEGER(nsv), n = *INTEGER(c);
+    const struct svm_node *p;
+
+    memset(model, 0, sizeof(*model));
+    model->svm_type    = -1;
+    model->kernel_type = *INTEGER(kernel_type);
+    model->gamma       = *REAL(sigma);
+    model->degree      = *INTEGER(degree);
+    model->coef0       = *REAL(offset);
+    model->nsv         = u;
+    model->ncol        = n;
+    model->nmodel      = LENGTH(b);
+    model->nclass      = *INTEGER(nclass);
+
+    *rows = sparsify(REAL(sv), u, n, NULL, u);
+    *rowptr = new int64_t[u + 1];
+    (*rowptr)[0] = 0;
+    for (i = 0; i < u; i++) {
+      for (p = (*rows)[i]; p->index != -1; p++)
+	;
+      (*rowptr)[i+1] = p + 1 - (*rows)[u];
+    }
+    model->rowptr  = *rowptr;
+    model->node    = (*rows)[u];
+    model->svindex = INTEGER(svindex);
+    model->start   = INTEGER(start);
+    model->coef    = REAL(coef);
+    model->b       = REAL(b);
+    model->center  = LENGTH(center) > 0 ? REAL(center) : NULL;
+    model->scale   = LENGTH(center) > 0 ? REAL(scale) : NULL;
+    model->ycenter = 0;
+    model->yscale  = 1;
+
+    *w = NULL;
+    if (LENGTH(given) > 0) {
+      if ((size_t) LENGTH(given) == svm_model_weights_size(model))
+	model->w = REAL(given);
+    }
+    else if (weights && svm_model_weights_size(model) > 0) {
+      *w = new double[svm_model_weights_size(model)];
+      svm_model_weights(model, *w);
+      model->w = *w;
+    }
+  }
+
+  /* Decision values of nm binary models that share the nsv x c matrix
+     of support vectors sv: model m has coefficients coef[k] on the rows
+     svindex[k] of sv, start[m] <= k < start[m+1], and offset b[m].
+     Each kernel value between a row of the r x c matrix x and a
+     support vector is computed once, however many models use it.
+     x is centered and scaled by center and scale unless they are
+     empty, a tile of rows at a time, so that the memory used does not
+     depend on r.  Linear and quadratic models are evaluated in their
+     explicit form, weights from svm_weights or, if it is empty, when r
+     is large enough to pay for computing it.  Returns the r x nm
+     decision values, or if nclass > 0 the nclass x r votes of the
+     one-against-one models 1-2, 1-3, ..., 2-3, ... */
+  SEXP svm_predict(SEXP x,
+		   SEXP r,
+		   SEXP c,
+		   SEXP sv,
+		   SEXP nsv,
+		   SEXP svindex,
+		   SEXP start,
+		   SEXP coef,
+		   SEXP b,
+		   SEXP nclass,
+		   SEXP center,
+		   SEXP scale,
+		   SEXP kernel_type,
+		   SEXP sigma,
+		   SEXP degree,
+		   SEXP offset,
+		   SEXP weights
+		   )
+  {
+    struct svm_model model;
+    struct svm_node **rows;
+    int64_t *rowptr;
+    double *w;
+    SEXP ans;
+    int l = *INTEGER(r), n = *INTEGER(c), k = *INTEGER(nclass);
+
+    /* the quadratic form costs about n rows of the kernel expansion */
+    r_model(&model, &rows, &rowptr, &w, l >= n || *INTEGER(degree) < 2, weights,
+	    sv, nsv, c, svindex, start, coef, b, nclass,
+	    center, scale, kernel_type, sigma, degree, offset);
+    if (k > 0)
+      PROTECT(ans = allocMatrix(REALSXP, k, l));
+    else
+      PROTECT(ans = allocMatrix(REALSXP, l, model.nmodel));
+    svm_model_predict(&model, REAL(x), l, n, REAL(ans), k > 0);
+
+    free_sparse(rows, model.nsv);
+    delete[] rowptr;
+    delete[] w;
+    UNPROTECT(1);
+    return ans;
+  }
+
+  /* The explicit weights of the models of svm_predict, see
+     svm_model_weights, computed once when a model is trained so that
+     svm_predict and svm_write_model need not compute them again;
+     numeric(0) for kernels without an explicit form, and for
+     quadratic models whose form would be larger than their support
+     vectors. */
+  SEXP svm_weights(SEXP sv,
+		   SEXP nsv,
+		   SEXP c,
+		   SEXP svindex,
+		   SEXP start,
+		   SEXP coef,
+		   SEXP b,
+		   SEXP kernel_type,
+		   SEXP sigma,
+		   SEXP degree,
+		   SEXP offset
+		   )
+  {
+    struct svm_model model;
+    struct svm_node **rows;
+    int64_t *rowptr;
+    double *w;
+    SEXP ans, empty, nclass;
+
+    PROTECT(empty = allocVector(REALSXP, 0));
+    PROTECT(nclass = ScalarInteger(0));
+    r_model(&model, &rows, &rowptr, &w, true, empty, sv, nsv, c, svindex, start, coef, b,
+	    nclass, empty, empty, kernel_type, sigma, degree, offset);
+    size_t size = w ? svm_model_weights_size(&model) : 0;
+    PROTECT(ans = allocVector(REALSXP, size));
+    if (size > 0)
+      memcpy(REAL(ans), w, size * sizeof(double));
+
+    free_sparse(rows, model.nsv);
+    delete[] rowptr;
+    delete[] w;
+    UNPROTECT(3);
+    return ans;
+  }
+
+  /* Write the model of svm_predict with svm_type, the class labels,
+     the center and scale of y and the weights of svm_weights, or
+     numeric(0) to compute them, to a model file, see svmmodel.h. */
+  SEXP svm_write_model(SEXP file,
+		       SEXP sv,
+		       SEXP nsv,
+		       SEXP c,
+		       SEXP svindex,
+		       SEXP start,
+		       SEXP coef,
+		       SEXP b,
+		       SEXP nclass,
+		       SEXP center,
+		       SEXP scale,
+		       SEXP kernel_type,
+		       SEXP sigma,
+		       SEXP degree,
+		       SEXP offset,
+		       SEXP svm_type,
+		       SEXP labels,
+		       SEXP numeric_labels,
+		       SEXP yscale,
+		       SEXP weights
+		       )
+  {
+    struct svm_model model;
+    struct svm_node **rows;
+    int64_t *rowptr;
+    double *w;
+    size_t size = 0;
+    int i, err;
+
+    r_model(&model, &rows, &rowptr, &w, true, weights, sv, nsv, c, svindex, start, coef, b,
+	    nclass, center, scale, kernel_type, sigma, degree, offset);
+    model.svm_type = *INTEGER(svm_type);
+    model.numeric_labels = *INTEGER(numeric_labels);
+    if (LENGTH(yscale) == 2) {
+      model.ycenter = REAL(yscale)[0];
+      model.yscale  = REAL(yscale)[1];
+    }
+    for (i = 0; i < model.nclass; i++)
+      size += strlen(CHAR(STRING_ELT(labels, i))) + 1;
+    char *lab = new char[size + 1];
+    for (size = i = 0; i < model.nclass; i++) {
+      strcpy(lab + size, CHAR(STRING_ELT(labels, i)));
+      size += strlen(lab + size) + 1;
+    }
+    model.labels = lab;
+
+    err = svm_model_write(&model, CHAR(STRING_ELT(file, 0)));
+
+    free_sparse(rows, model.nsv);
+    delete[] rowptr;
+    delete[] w;
+    delete[] lab;
+    if (err)
+      error("cannot write the model file %s", CHAR(STRING_ELT(file, 0)));
+    return R_NilValue;
+  }
+
+  static void model_finalizer(SEXP ptr)
+  {
+    svm_model_free((struct svm_model *) R_ExternalPtrAddr(ptr));
+    R_ClearExternalPtr(ptr);
+  }
+
+  /* Map a model file.  Returns a list of the model, an external
+     pointer that unmaps the file when it is garbage collected, and
+     its svm_type, class labels and number of columns. */
+  SEXP svm_map_model(SEXP file)
+  {
+    const char *msg;
+    struct svm_model *model = svm_model_map(CHAR(STRING_ELT(file, 0)), &msg);
+    SEXP ans, ptr, labels, names;
+    const char *lab;
+    int i;
+
+    if (model == NULL)
+      error("%s: %s", msg, CHAR(STRING_ELT(file, 0)));
+    PROTECT(ptr = R_MakeExternalPtr(model, R_NilValue, R_NilValue));
+    R_RegisterCFinalizerEx(ptr, model_finalizer, TRUE);
+
+    PROTECT(labels = allocVector(STRSXP, model->nclass));
+    for (i = 0, lab = model->labels; i < model->nclass; i++, lab += strlen(lab) + 1)
+      SET_STRING_ELT(labels, i, mkChar(lab));
+
+    PROTECT(ans = allocVector(VECSXP, 5));
+    SET_VECTOR_ELT(ans, 0, ptr);
+    SET_VECTOR_ELT(ans, 1, ScalarInteger(model->svm_type));
+    SET_VECTOR_ELT(ans, 2, labels);
+    SET_VECTOR_ELT(ans, 3, ScalarLogical(model->numeric_labels));
+    SET_VECTOR_ELT(ans, 4, ScalarInteger(model->ncol));
+    PROTECT(names = allocVector(STRSXP, 5));
+    SET_STRING_ELT(names, 0, mkChar("pointer"));
+    SET_STRING_ELT(names, 1, mkChar("svm_type"));
+    SET_STRING_ELT(names, 2, mkChar("lev"));
+    SET_STRING_ELT(names, 3, mkChar("numeric"));
+    SET_STRING_ELT(names, 4, mkChar("ncol"));
+    setAttrib(ans, R_NamesSymbol, names);
+    UNPROTECT(4);
+    return ans;
+  }
+
+  /* svm_predict for the r x c matrix x on a mapped model */
+  SEXP svm_predict_model(SEXP model, SEXP x, SEXP r, SEXP c, SEXP votes)
+  {
+    struct svm_model *m = (struct svm_model *) R_ExternalPtrAddr(model);
+    int l = *INTEGER(r), n = *INTEGER(c);
+    SEXP ans;
+
+    if (m == NULL)
+      error("the model file is no longer mapped");
+    if (n != m->ncol)
+      error("test vector does not match model !");
+    if (*INTEGER(votes))
+      PROTECT(ans = allocMatrix(REALSXP, m->nclass, l));
+    else
+      PROTECT(ans = allocMatrix(REALSXP, l, m->nmodel));
+    svm_model_predict(m, REAL(x), l, n, REAL(ans), *INTEGER(votes));
+    UNPROTECT(1);
+    return ans;
+  }
 }
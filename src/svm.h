@@ -20,6 +20,7 @@ struct svm_problem
 
 enum { C_SVC, NU_SVC, ONE_CLASS, EPSILON_SVR, NU_SVR, C_BSVC, EPSILON_BSVR, SPOC, KBB };	/* svm_type */
 enum { LINEAR, POLY, RBF, SIGMOID, R, LAPLACE, BESSEL, ANOVA, SPLINE };	/* kernel_type */
+enum { LINEAR_TRON, LINEAR_DCD, LINEAR_PRIMAL };	/* linear_solver */
 
 struct svm_parameter
 {
@@ -44,6 +45,9 @@ struct svm_parameter
         double lim; /* for bessel kernel */
         double *K; /* pointer to kernel matrix */
         int m;
+        int npairs; /* disjoint pairs updated per SMO iteration */
+        int cascade; /* subsets in the first cascade layer, 0 = off */
+        int linear_solver; /* for C_BSVC/EPSILON_BSVR with a linear kernel */
 };
 
 struct BQP
@@ -51,8 +55,45 @@ struct BQP
    double eps;
    int n;
    double *x, *C, *Q, *p;
+   double *work; /* BQP_WORKSIZE(n) doubles, reused by every solve */
+   int *iwork;   /* n ints */
 };
 
+#define BQP_WORKSIZE(n) (2*(n)*(n)+16*(n))
+
+/* state of one TRON solve, so that several may run concurrently.
+   dtron sees the objective only through fv, grad and hv; grad is
+   always called at the point of the last fv and fixes the Hessian
+   used by hv until the next grad. */
+struct tron_ctx
+ {
+   int (*fv)(struct tron_ctx *, int n, double *x, double *f);  /* returns nfev */
+   void (*grad)(struct tron_ctx *, int n, double *x, double *g);
+   void (*hv)(struct tron_ctx *, int n, double *v, double *Hv);
+   double *diag;   /* diag(H), set by grad for a matrix-free H */
+   double *A, *g0; /* f(x) = 0.5*x'*A*x + g0'*x, A = NULL if matrix-free */
+   void *prob;     /* data of a matrix-free objective */
+   int nfev;       /* function evaluations so far */
+   double lambda;  /* diagonal shift for a semidefinite A */
+   double *t;      /* n doubles of scratch for fv */
+};
+
+/* the Hessian on the variables ind[0..n) seen by dcauchy, dprsrch
+   and dtrpcg, with its preconditioner L*L' */
+struct tron_hess
+ {
+   struct tron_ctx *ctx;
+   double *B;      /* dense n*n H(ind,ind), or NULL to apply ctx->hv */
+   double *L;      /* Cholesky factor of B, or the square root of diag(H)(ind) */
+   int *ind;       /* NULL for all variables */
+   int nfull;      /* number of variables of ctx */
+   double *v, *Hv; /* nfull doubles of scratch for ctx->hv if ind is set,
+                      v is zero outside calls */
+};
+
+/* work for dtron with a matrix-free H; a dense A needs BQP_WORKSIZE */
+#define TRON_WORKSIZE(n) (17*(n))
+
 
 #ifdef __cplusplus
 }
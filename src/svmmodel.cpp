@@ -0,0 +1,760 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <sys/stat.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#include "svmmodel.h"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+template <class T> static inline T min(T x,T y) { return (x<y)?x:y; }
+
+static inline double powi(double base, int times)
+{
+	double tmp = base, ret = 1.0;
+
+	for(int t=times; t>0; t/=2)
+	{
+		if(t%2==1) ret*=tmp;
+		tmp = tmp * tmp;
+	}
+	return ret;
+}
+
+//
+// Kernel evaluation, as Kernel::k_function of svm.cpp for the kernels
+// whose definition agrees with that of kernlab's R kernels
+//
+static double dot(const svm_node *px, const svm_node *py)
+{
+	double sum = 0;
+	while(px->index != -1 && py->index != -1)
+	{
+		if(px->index == py->index)
+		{
+			sum += px->value * py->value;
+			++px;
+			++py;
+		}
+		else
+		{
+			if(px->index > py->index)
+				++py;
+			else
+				++px;
+		}
+	}
+	return sum;
+}
+
+static double dist2(const svm_node *x, const svm_node *y)
+{
+	double sum = 0;
+	while(x->index != -1 && y->index != -1)
+	{
+		if(x->index == y->index)
+		{
+			double d = x->value - y->value;
+			sum += d*d;
+			++x;
+			++y;
+		}
+		else
+		{
+			if(x->index > y->index)
+			{
+				sum += y->value * y->value;
+				++y;
+			}
+			else
+			{
+				sum += x->value * x->value;
+				++x;
+			}
+		}
+	}
+	for(; x->index != -1; ++x)
+		sum += x->value * x->value;
+	for(; y->index != -1; ++y)
+		sum += y->value * y->value;
+	return sum;
+}
+
+static double kernel(const svm_node *x, const svm_node *y, const svm_model *m)
+{
+	switch(m->kernel_type)
+	{
+		case LINEAR:
+			return dot(x,y);
+		case POLY:
+			return powi(m->gamma*dot(x,y)+m->coef0,m->degree);
+		case RBF:
+			return exp(-m->gamma*dist2(x,y));
+		case SIGMOID:
+			return tanh(m->gamma*dot(x,y)+m->coef0);
+		case LAPLACE:
+			return exp(-m->gamma*sqrt(dist2(x,y)));
+		default:
+			return 0;
+	}
+}
+
+// rows from, ..., to-1 of the r x c matrix x, scaled as the model
+// says, in space, (to-from)*(c+1) nodes
+static void scaled_rows(const svm_model *m, const double *x, int r, int c,
+			int from, int to, svm_node *space, svm_node **rows, int *count)
+{
+	int n = to - from;
+	for(int i=0;i<n;i++)
+	{
+		rows[i] = space + (size_t) i * (c + 1);
+		count[i] = 0;
+	}
+	for(int j=0;j<c;j++)
+	{
+		const double *col = x + (size_t) j * r;
+		for(int i=0;i<n;i++)
+		{
+			double v = col[from + i];
+			if(m->center)
+				v = (v - m->center[j]) / m->scale[j];
+			if(v != 0)
+			{
+				rows[i][count[i]].index = j + 1;
+				rows[i][count[i]++].value = v;
+			}
+		}
+	}
+	for(int i=0;i<n;i++)
+		rows[i][count[i]].index = -1;
+}
+
+// whether the explicit form of the models has a quadratic part, and
+// the number of doubles of the form of one model
+static bool quadratic(const svm_model *m)
+{
+	return m->kernel_type == POLY && m->degree == 2;
+}
+
+static size_t weight_block(const svm_model *m)
+{
+	return 1 + m->ncol + (quadratic(m) ? (size_t) m->ncol * m->ncol : 0);
+}
+
+size_t svm_model_weights_size(const struct svm_model *m)
+{
+	const int nm = m->nmodel;
+	if(nm == 0)
+		return 0;
+	if(m->kernel_type == LINEAR || (m->kernel_type == POLY && m->degree == 1))
+		return nm * weight_block(m);
+	// the ncol^2 quadratic form against ncol values per support vector
+	if(quadratic(m) && (int64_t) m->ncol * nm <= m->start[nm])
+		return nm * weight_block(m);
+	return 0;
+}
+
+// for model mm: w[0] = c0^d sum a - b, w[1..ncol] = d g c0^(d-1) sum a sv
+// and for d = 2 the ncol x ncol matrix g^2 sum a sv sv'
+void svm_model_weights(const struct svm_model *m, double *w)
+{
+	const int n = m->ncol;
+	const bool quad = quadratic(m);
+	const double g = m->kernel_type == LINEAR ? 1 : m->gamma;
+	const double c0 = m->kernel_type == LINEAR ? 0 : m->coef0;
+	const size_t bs = weight_block(m);
+
+	memset(w, 0, sizeof(double) * bs * m->nmodel);
+	for(int mm=0;mm<m->nmodel;mm++)
+	{
+		double *wm = w + mm*bs, *lin = wm + 1, *Q = lin + n;
+		double sa = 0;
+		for(int j=m->start[mm];j<m->start[mm+1];j++)
+		{
+			const double a = m->coef[j];
+			const svm_node *s = m->node + m->rowptr[m->svindex[j]-1];
+			sa += a;
+			for(const svm_node *p=s;p->index!=-1;++p)
+			{
+				lin[p->index-1] += a * p->value;
+				if(quad)
+				{
+					double *row = Q + (size_t) (p->index-1) * n - 1;
+					for(const svm_node *q=s;q->index!=-1;++q)
+						row[q->index] += a * p->value * q->value;
+				}
+			}
+		}
+		if(quad)
+		{
+			for(size_t i=0;i<(size_t) n*n;i++)
+				Q[i] *= g * g;
+			for(int i=0;i<n;i++)
+				lin[i] *= 2 * g * c0;
+			wm[0] = c0 * c0 * sa - m->b[mm];
+		}
+		else
+		{
+			for(int i=0;i<n;i++)
+				lin[i] *= g;
+			wm[0] = c0 * sa - m->b[mm];
+		}
+	}
+}
+
+// decision value of model mm in explicit form, cost linear in the
+// nonzeros of x, quadratic for degree 2
+static double explicit_decision(const svm_model *m, int mm, const svm_node *x)
+{
+	const int n = m->ncol;
+	const double *wm = m->w + mm * weight_block(m);
+	double d = wm[0];
+	for(const svm_node *p=x;p->index!=-1;++p)
+		d += wm[p->index] * p->value;
+	if(quadratic(m))
+	{
+		const double *Q = wm + 1 + n;
+		for(const svm_node *p=x;p->index!=-1;++p)
+		{
+			const double *row = Q + (size_t) (p->index-1) * n - 1;
+			double s = 0;
+			for(const svm_node *q=x;q->index!=-1;++q)
+				s += row[q->index] * q->value;
+			d += p->value * s;
+		}
+	}
+	return d;
+}
+
+void svm_model_predict(const struct svm_model *m, const double *x,
+		       int l, int n, double *out, int votes)
+{
+	const int u = m->nsv, nm = m->nmodel, k = m->nclass;
+	const int *index = m->svindex, *first = m->start;
+	const double *w = m->coef, *rho = m->b;
+	const bool regression = m->svm_type == EPSILON_SVR ||
+		m->svm_type == NU_SVR || m->svm_type == EPSILON_BSVR;
+
+	if(votes)
+		memset(out, 0, sizeof(double) * k * l);
+	// tiles of test points sweep blocks of support vectors, so a block
+	// is read from cache by every point of the tile
+	const int tile = 16, block = 256;
+#pragma omp parallel
+	{
+		double *kv = m->w ? NULL : new double[(size_t) tile * u];
+		svm_node *space = new svm_node[(size_t) tile * (n + 1)];
+		svm_node *xs[tile];
+		int count[tile];
+#pragma omp for schedule(dynamic)
+		for(int t0=0;t0<l;t0+=tile)
+		{
+			int t1 = min(t0+tile, l);
+			scaled_rows(m, x, l, n, t0, t1, space, xs, count);
+			for(int s0=0;s0<u && !m->w;s0+=block)
+			{
+				int s1 = min(s0+block, u);
+				for(int i=t0;i<t1;i++)
+					for(int s=s0;s<s1;s++)
+						kv[(size_t) (i-t0)*u+s] = kernel(xs[i-t0], m->node + m->rowptr[s], m);
+			}
+			for(int i=t0;i<t1;i++)
+			{
+				const double *ki = kv + (size_t) (i-t0)*u;
+				int ci = 0, cj = 1;
+				for(int mm=0;mm<nm;mm++)
+				{
+					double d = 0;
+					if(m->w)
+						d = explicit_decision(m, mm, xs[i-t0]);
+					else
+					{
+						for(int j=first[mm];j<first[mm+1];j++)
+							d += w[j]*ki[index[j]-1];
+						d -= rho[mm];
+					}
+					if(votes)
+					{
+						if(d < 0)
+							out[(size_t) i*k+ci]++;
+						else if(d > 0)
+							out[(size_t) i*k+cj]++;
+						if(++cj == k)
+						{
+							ci++;
+							cj = ci+1;
+						}
+					}
+					else
+						out[(size_t) mm*l+i] = regression ? d*m->yscale+m->ycenter : d;
+				}
+			}
+		}
+		delete[] kv;
+		delete[] space;
+	}
+}
+
+size_t svm_model_work_size(const struct svm_model *m)
+{
+	return sizeof(double) * (m->nsv + m->nclass) + sizeof(svm_node) * (m->ncol + 1);
+}
+
+// one row of ncol values at a time, in the caller's workspace: the
+// scaled row, the kernel values against all support vectors and the
+// votes of the classes
+template <class T>
+static int score(const svm_model *m, const T *row, double *dec, void *work)
+{
+	double *kv = (double *) work;
+	double *vote = kv + m->nsv;
+	svm_node *x = (svm_node *) (vote + m->nclass);
+	int n = 0, best = 0;
+
+	for(int j=0;j<m->ncol;j++)
+	{
+		double v = row[j];
+		if(m->center)
+			v = (v - m->center[j]) / m->scale[j];
+		if(v != 0)
+		{
+			x[n].index = j + 1;
+			x[n++].value = v;
+		}
+	}
+	x[n].index = -1;
+	for(int s=0;s<m->nsv && !m->w;s++)
+		kv[s] = kernel(x, m->node + m->rowptr[s], m);
+	for(int mm=0;mm<m->nmodel;mm++)
+	{
+		if(m->w)
+		{
+			dec[mm] = explicit_decision(m, mm, x);
+			continue;
+		}
+		double d = 0;
+		for(int j=m->start[mm];j<m->start[mm+1];j++)
+			d += m->coef[j]*kv[m->svindex[j]-1];
+		dec[mm] = d - m->b[mm];
+	}
+
+	switch(m->svm_type)
+	{
+		case EPSILON_SVR:
+		case NU_SVR:
+		case EPSILON_BSVR:
+			for(int mm=0;mm<m->nmodel;mm++)
+				dec[mm] = dec[mm]*m->yscale+m->ycenter;
+			return -1;
+		case ONE_CLASS:
+			return dec[0] > 0;
+		case SPOC:
+			for(int i=1;i<m->nclass;i++)
+				if(dec[i] > dec[best])
+					best = i;
+			return best;
+	}
+	int ci = 0, cj = 1;
+	memset(vote, 0, sizeof(double) * m->nclass);
+	for(int mm=0;mm<m->nmodel;mm++)
+	{
+		if(dec[mm] < 0)
+			vote[ci]++;
+		else if(dec[mm] > 0)
+			vote[cj]++;
+		if(++cj == m->nclass)
+		{
+			ci++;
+			cj = ci+1;
+		}
+	}
+	for(int i=1;i<m->nclass;i++)
+		if(vote[i] > vote[best])
+			best = i;
+	return best;
+}
+
+int svm_model_score(const struct svm_model *m, const double *row, double *dec, void *work)
+{
+	return score(m, row, dec, work);
+}
+
+int svm_model_score_float(const struct svm_model *m, const float *row, double *dec, void *work)
+{
+	return score(m, row, dec, work);
+}
+
+const char *svm_model_label(const struct svm_model *m, int i)
+{
+	if(i < 0 || i >= m->nclass)
+		return NULL;
+	const char *lab = m->labels;
+	while(i-- > 0)
+		lab += strlen(lab) + 1;
+	return lab;
+}
+
+//
+// Model files: a header followed by the arrays of svm_model, each
+// starting at a multiple of 8 bytes, so that a mapped file is used as
+// it is.  Files are only read on machines with the byte order and
+// svm_node layout of the writer.
+//
+#define MODEL_MAGIC "kernlab\n"
+#define MODEL_VERSION 2
+#define BYTE_ORDER_MARK 0x01020304
+
+struct model_file
+{
+	char magic[8];
+	int32_t version, byte_order;
+	int32_t svm_type, kernel_type, degree, nsv, ncol, nmodel, nclass, numeric_labels;
+	int32_t node_size, reserved;
+	double gamma, coef0, ycenter, yscale;
+	int64_t nnode, ncoef, labels_size, nw;
+	// offsets of the arrays, 0 for a missing one, and the file size
+	int64_t rowptr, node, svindex, start, coef, b, center, scale, labels, w, size;
+};
+
+static int64_t align8(int64_t n)
+{
+	return (n + 7) & ~(int64_t) 7;
+}
+
+static int write_at(FILE *f, int64_t offset, const void *p, size_t size)
+{
+	static const char zero[8] = {0};
+	long pos = ftell(f);
+	if(pos < 0 || fwrite(zero, 1, (size_t) (offset - pos), f) != (size_t) (offset - pos))
+		return -1;
+	return fwrite(p, 1, size, f) == size ? 0 : -1;
+}
+
+int svm_model_write(const struct svm_model *m, const char *file)
+{
+	model_file h;
+	int64_t end, *rowptr;
+	int i, ret = 0;
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, MODEL_MAGIC, 8);
+	h.version = MODEL_VERSION;
+	h.byte_order = BYTE_ORDER_MARK;
+	h.node_size = sizeof(svm_node);
+	h.svm_type = m->svm_type;
+	h.kernel_type = m->kernel_type;
+	h.degree = m->degree;
+	h.nsv = m->nsv;
+	h.ncol = m->ncol;
+	h.nmodel = m->nmodel;
+	h.nclass = m->nclass;
+	h.numeric_labels = m->numeric_labels;
+	h.gamma = m->gamma;
+	h.coef0 = m->coef0;
+	h.ycenter = m->ycenter;
+	h.yscale = m->yscale;
+	h.nnode = m->rowptr[m->nsv] - m->rowptr[0];
+	h.ncoef = m->start[m->nmodel];
+	for(i=0;i<m->nclass;i++)
+		h.labels_size += strlen(m->labels + h.labels_size) + 1;
+
+	end = align8(sizeof(h));
+	h.rowptr = end; end = align8(end + (m->nsv + 1) * sizeof(int64_t));
+	h.node = end; end = align8(end + h.nnode * sizeof(svm_node));
+	h.svindex = end; end = align8(end + h.ncoef * sizeof(int));
+	h.start = end; end = align8(end + (m->nmodel + 1) * sizeof(int));
+	h.coef = end; end = align8(end + h.ncoef * sizeof(double));
+	h.b = end; end = align8(end + m->nmodel * sizeof(double));
+	if(m->center)
+	{
+		h.center = end; end = align8(end + m->ncol * sizeof(double));
+		h.scale = end; end = align8(end + m->ncol * sizeof(double));
+	}
+	h.labels = end; end = align8(end + h.labels_size);
+	if(m->w)
+	{
+		h.nw = m->nmodel * weight_block(m);
+		h.w = end; end = align8(end + h.nw * sizeof(double));
+	}
+	h.size = end;
+
+	// rows relative to the first one
+	rowptr = new int64_t[m->nsv + 1];
+	for(i=0;i<=m->nsv;i++)
+		rowptr[i] = m->rowptr[i] - m->rowptr[0];
+
+	// a new file renamed over the old one, so that processes which
+	// still map the old file keep reading its pages
+	char *tmp = new char[strlen(file) + 8];
+	FILE *f;
+#ifdef _WIN32
+	sprintf(tmp, "%s.tmp", file);
+	f = fopen(tmp, "wb");
+#else
+	sprintf(tmp, "%s.XXXXXX", file);
+	int fd = mkstemp(tmp);
+	f = fd < 0 ? NULL : fdopen(fd, "wb");
+	if(f == NULL && fd >= 0)
+	{
+		close(fd);
+		remove(tmp);
+	}
+#endif
+	if(f == NULL)
+	{
+		delete[] rowptr;
+		delete[] tmp;
+		return -1;
+	}
+	ret |= write_at(f, 0, &h, sizeof(h));
+	ret |= write_at(f, h.rowptr, rowptr, (m->nsv + 1) * sizeof(int64_t));
+	ret |= write_at(f, h.node, m->node + m->rowptr[0], h.nnode * sizeof(svm_node));
+	ret |= write_at(f, h.svindex, m->svindex, h.ncoef * sizeof(int));
+	ret |= write_at(f, h.start, m->start, (m->nmodel + 1) * sizeof(int));
+	ret |= write_at(f, h.coef, m->coef, h.ncoef * sizeof(double));
+	ret |= write_at(f, h.b, m->b, m->nmodel * sizeof(double));
+	if(m->center)
+	{
+		ret |= write_at(f, h.center, m->center, m->ncol * sizeof(double));
+		ret |= write_at(f, h.scale, m->scale, m->ncol * sizeof(double));
+	}
+	ret |= write_at(f, h.labels, m->labels, h.labels_size);
+	if(m->w)
+		ret |= write_at(f, h.w, m->w, h.nw * sizeof(double));
+	ret |= write_at(f, h.size, NULL, 0);
+	if(fclose(f) != 0)
+		ret = -1;
+#ifndef _WIN32
+	// mkstemp creates the file readable by its owner only
+	if(ret == 0)
+	{
+		mode_t mask = umask(0);
+		umask(mask);
+		if(chmod(tmp, 0666 & ~mask) != 0)
+			ret = -1;
+	}
+#else
+	// rename does not replace an existing file
+	if(ret == 0)
+		remove(file);
+#endif
+	if(ret == 0 && rename(tmp, file) != 0)
+		ret = -1;
+	if(ret != 0)
+		remove(tmp);
+	delete[] rowptr;
+	delete[] tmp;
+	return ret;
+}
+
+// whether the array of n elements of the given size at offset lies
+// within a file of the given size
+static bool inside(int64_t offset, int64_t n, size_t size, int64_t file_size)
+{
+	return offset > 0 && offset % 8 == 0 && n >= 0 &&
+		offset <= file_size && n <= (file_size - offset) / (int64_t) size;
+}
+
+// whether the arrays of a file whose sections lie within it are
+// consistent, so that prediction never indexes outside them
+static bool valid_arrays(const model_file *h, const char *base)
+{
+	const int64_t *rowptr = (const int64_t *) (base + h->rowptr);
+	const svm_node *node = (const svm_node *) (base + h->node);
+	const int *svindex = (const int *) (base + h->svindex);
+	const int *start = (const int *) (base + h->start);
+	const char *lab = base + h->labels, *end = lab + h->labels_size;
+	int64_t i;
+
+	switch(h->svm_type)
+	{
+		case C_SVC:
+		case NU_SVC:
+		case C_BSVC:
+			if(h->nclass < 2 || h->nmodel != (int64_t) h->nclass * (h->nclass - 1) / 2)
+				return false;
+			break;
+		case SPOC:
+			if(h->nclass < 2 || h->nmodel != h->nclass)
+				return false;
+			break;
+		case ONE_CLASS:
+		case EPSILON_SVR:
+		case NU_SVR:
+		case EPSILON_BSVR:
+			if(h->nmodel != 1)
+				return false;
+			break;
+		default:
+			return false;
+	}
+	if(h->kernel_type != LINEAR && h->kernel_type != POLY && h->kernel_type != RBF &&
+	   h->kernel_type != SIGMOID && h->kernel_type != LAPLACE)
+		return false;
+	if(h->w && !(h->kernel_type == LINEAR || (h->kernel_type == POLY && h->degree <= 2)))
+		return false;
+
+	if(start[0] != 0 || start[h->nmodel] != h->ncoef)
+		return false;
+	for(i=0;i<h->nmodel;i++)
+		if(start[i+1] < start[i])
+			return false;
+	for(i=0;i<h->ncoef;i++)
+		if(svindex[i] < 1 || svindex[i] > h->nsv)
+			return false;
+
+	// every row ends in its own terminator, with increasing indices
+	if(rowptr[0] != 0 || rowptr[h->nsv] != h->nnode)
+		return false;
+	for(i=0;i<h->nsv;i++)
+	{
+		if(rowptr[i+1] <= rowptr[i] || rowptr[i+1] > h->nnode ||
+		   node[rowptr[i+1]-1].index != -1)
+			return false;
+		int last = 0;
+		for(int64_t k=rowptr[i];k<rowptr[i+1]-1;k++)
+		{
+			if(node[k].index <= last || node[k].index > h->ncol)
+				return false;
+			last = node[k].index;
+		}
+	}
+
+	for(i=0;i<h->nclass;i++)
+	{
+		const char *nul = (const char *) memchr(lab, 0, end - lab);
+		if(nul == NULL)
+			return false;
+		lab = nul + 1;
+	}
+	return true;
+}
+
+struct svm_model *svm_model_map(const char *file, const char **error)
+{
+	void *data;
+	size_t size;
+
+#ifdef _WIN32
+	// no mmap, the file is read instead
+	struct stat st;
+	FILE *f = fopen(file, "rb");
+	if(f == NULL || stat(file, &st) != 0)
+	{
+		if(f) fclose(f);
+		*error = "cannot open the model file";
+		return NULL;
+	}
+	size = st.st_size;
+	data = malloc(size > 0 ? size : 1);
+	if(data == NULL || fread(data, 1, size, f) != size)
+	{
+		free(data);
+		fclose(f);
+		*error = "cannot read the model file";
+		return NULL;
+	}
+	fclose(f);
+#else
+	struct stat st;
+	int fd = open(file, O_RDONLY);
+	if(fd < 0 || fstat(fd, &st) != 0)
+	{
+		if(fd >= 0) close(fd);
+		*error = "cannot open the model file";
+		return NULL;
+	}
+	size = st.st_size;
+	data = size > 0 ? mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+	close(fd);
+	if(data == MAP_FAILED)
+	{
+		*error = "cannot map the model file";
+		return NULL;
+	}
+#endif
+
+	const model_file *h = (const model_file *) data;
+	const char *base = (const char *) data;
+	const char *msg = NULL;
+	int64_t fs = size;
+	if(size < sizeof(model_file) || memcmp(h->magic, MODEL_MAGIC, 8) != 0)
+		msg = "not a kernlab model file";
+	else if(h->version != MODEL_VERSION)
+		msg = "unsupported model file version";
+	else if(h->byte_order != BYTE_ORDER_MARK || h->node_size != sizeof(svm_node))
+		msg = "model file written on an incompatible machine";
+	else if(h->size != fs || h->nsv < 0 || h->ncol < 0 || h->nmodel < 0 || h->nclass < 0 ||
+		!inside(h->rowptr, h->nsv + 1, sizeof(int64_t), fs) ||
+		!inside(h->node, h->nnode, sizeof(svm_node), fs) ||
+		!inside(h->svindex, h->ncoef, sizeof(int), fs) ||
+		!inside(h->start, h->nmodel + 1, sizeof(int), fs) ||
+		!inside(h->coef, h->ncoef, sizeof(double), fs) ||
+		!inside(h->b, h->nmodel, sizeof(double), fs) ||
+		(h->center && (!inside(h->center, h->ncol, sizeof(double), fs) ||
+			       !inside(h->scale, h->ncol, sizeof(double), fs))) ||
+		!inside(h->labels, h->labels_size, 1, fs) ||
+		(h->w && (h->nw != h->nmodel * (1 + h->ncol + (h->kernel_type == POLY && h->degree == 2 ?
+								(int64_t) h->ncol * h->ncol : 0)) ||
+			  !inside(h->w, h->nw, sizeof(double), fs))) ||
+		!valid_arrays(h, base))
+		msg = "corrupt model file";
+	if(msg)
+	{
+#ifdef _WIN32
+		free(data);
+#else
+		munmap(data, size);
+#endif
+		*error = msg;
+		return NULL;
+	}
+
+	svm_model *m = (svm_model *) calloc(1, sizeof(svm_model));
+	m->svm_type = h->svm_type;
+	m->kernel_type = h->kernel_type;
+	m->degree = h->degree;
+	m->gamma = h->gamma;
+	m->coef0 = h->coef0;
+	m->nsv = h->nsv;
+	m->ncol = h->ncol;
+	m->nmodel = h->nmodel;
+	m->nclass = h->nclass;
+	m->rowptr = (const int64_t *) (base + h->rowptr);
+	m->node = (const svm_node *) (base + h->node);
+	m->svindex = (const int *) (base + h->svindex);
+	m->start = (const int *) (base + h->start);
+	m->coef = (const double *) (base + h->coef);
+	m->b = (const double *) (base + h->b);
+	m->center = h->center ? (const double *) (base + h->center) : NULL;
+	m->scale = h->center ? (const double *) (base + h->scale) : NULL;
+	m->ycenter = h->ycenter;
+	m->yscale = h->yscale;
+	m->labels = base + h->labels;
+	m->numeric_labels = h->numeric_labels;
+	m->w = h->w ? (const double *) (base + h->w) : NULL;
+	m->data = data;
+	m->size = size;
+	return m;
+}
+
+void svm_model_free(struct svm_model *m)
+{
+	if(m == NULL)
+		return;
+	if(m->data)
+#ifdef _WIN32
+		free(m->data);
+#else
+		munmap(m->data, m->size);
+#endif
+	free(m);
+}
@@ -0,0 +1,95 @@
+#ifndef _SVMMODEL_H
+#define _SVMMODEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "svm.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* nmodel kernel expansions sharing the nsv support vectors sv:
+   model m is sum_k coef[k] K(x, sv[svindex[k]-1]) - b[m] over
+   start[m] <= k < start[m+1].  Row i of sv is node[rowptr[i]], ...,
+   up to its terminating index -1.  The arrays either belong to the
+   caller or lie in the mapping of a model file. */
+struct svm_model
+{
+	int svm_type;
+	int kernel_type;
+	int degree;
+	double gamma;
+	double coef0;
+
+	int nsv, ncol, nmodel;
+	int nclass;            /* 0 for regression and novelty detection */
+	const int64_t *rowptr; /* nsv+1 */
+	const struct svm_node *node;
+	const int *svindex;    /* start[nmodel], 1-based */
+	const int *start;      /* nmodel+1 */
+	const double *coef;    /* start[nmodel] */
+	const double *b;       /* nmodel */
+	const double *center;  /* ncol, x is (x-center)/scale; NULL if unscaled */
+	const double *scale;
+	double ycenter, yscale;    /* regression output is y*yscale+ycenter */
+	const char *labels;    /* nclass NUL terminated class labels */
+	int numeric_labels;
+	const double *w;       /* explicit form of the models, or NULL */
+
+	void *data;            /* mapping of a model file, or NULL */
+	size_t size;
+};
+
+/* r x nmodel decision values of the r x c column-major x in out,
+   or if votes the nclass x r one-against-one votes of models 1-2,
+   1-3, ..., 2-3, ...  The values of regression models are scaled by
+   yscale and ycenter.  Uses memory independent of r. */
+void svm_model_predict(const struct svm_model *model, const double *x,
+		       int r, int c, double *out, int votes);
+
+/* Scoring of single rows without R, e.g. from a server that maps a
+   file saved by saveModel: svmmodel.cpp only needs svm.h and builds
+   on its own into libkernlabmodel with the Makefile in inst/lib, whose
+   score.c is an example client.  The model is never modified, so one
+   model serves any number of threads as long as each passes its own
+   workspace. */
+
+/* bytes of workspace svm_model_score needs for model */
+size_t svm_model_work_size(const struct svm_model *model);
+
+/* nmodel decision values of the ncol values of row in dec, scaled as
+   for svm_model_predict.  Returns the 0-based index of the predicted
+   class, by votes or by the largest decision value for SPOC, 1 or 0
+   for novelty detection and -1 for regression.  Does not allocate;
+   work holds svm_model_work_size(model) bytes aligned for a double. */
+int svm_model_score(const struct svm_model *model, const double *row,
+		    double *dec, void *work);
+int svm_model_score_float(const struct svm_model *model, const float *row,
+			  double *dec, void *work);
+
+/* label of class i, NULL if there is none */
+const char *svm_model_label(const struct svm_model *model, int i);
+
+/* Models with a linear kernel, or a polynomial one of degree 1 or 2,
+   are sums of a constant, a linear and for degree 2 a quadratic form
+   of x.  svm_model_weights_size is the number of doubles of these
+   forms for all models, 0 if the kernel has none or evaluating it is
+   not cheaper than the kernel expansion; svm_model_weights computes
+   them in w, which the predictors use once model->w is set to it. */
+size_t svm_model_weights_size(const struct svm_model *model);
+void svm_model_weights(const struct svm_model *model, double *w);
+
+/* write model to file in the native byte order; 0 on success */
+int svm_model_write(const struct svm_model *model, const char *file);
+
+/* map a file written by svm_model_write, NULL with a message in error
+   if it is not one; release with svm_model_free */
+struct svm_model *svm_model_map(const char *file, const char **error);
+void svm_model_free(struct svm_model *model);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _SVMMODEL_H */